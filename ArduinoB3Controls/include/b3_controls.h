@@ -5,9 +5,13 @@
 #ifndef B3_CONTROLS_H
 #define B3_CONTROLS_H
 
+#include "b3_pedal_curves.h"
 #include "b3_percussion.h"
 #include "b3_vibrato_chorus.h"
 #include <Arduino.h>
+#include <B3Command.h>
+#include <B3Leds.h>
+#include <B3Midi.h>
 
 #define CTRL_INIT 127
 
@@ -17,6 +21,27 @@
 
 #define VOLUME_CONTROL 7  // expression pedal controller
 
+// Expression pedal measure:
+// - ADC0 accumulates EXPR_PEDAL_OVERSAMPLING conversions of the pedal (SAMPNUM),
+// - exponential moving average of these measures over about
+//   2^EXPR_PEDAL_EMA_SHIFT refresh ticks,
+// - hysteresis (see is_expression_pedal_change_significant()): a new position
+//   is only sent once the filtered measure has moved by EXPR_PEDAL_HYSTERESIS
+//   (10-bit counts) from the one last sent, or has reached an end of the
+//   pedal travel,
+// - rate limit: at most one CC triplet (upper, lower, pedal channels) every
+//   EXPR_PEDAL_CC_INTERVAL_MS; a significant change coming earlier is sent once
+//   the interval is over, with the latest position: the position the pedal
+//   rests on is always sent.
+#define EXPR_PEDAL_SAMPNUM ADC_SAMPNUM_ACC16_gc
+#define EXPR_PEDAL_OVERSAMPLING 16
+#define EXPR_PEDAL_EMA_SHIFT 2
+#define EXPR_PEDAL_HYSTERESIS 4
+#define EXPR_PEDAL_CC_INTERVAL_MS 30
+
+// position value before the first CC triplet is sent
+#define EXPR_PEDAL_NONE 0xFF
+
 // ------------- MIDI Program values found by running 'setbfree -d' -----------
 
 #define OVERDRIVE_OFF 40
@@ -27,17 +52,35 @@
 #define LESLIE_FAST 54
 
 // sent by Raspberry PI to identify the Controls board
-#define CONTROLS_IDENTIFIER "C"
+#define CONTROLS_IDENTIFIER B3_COMMAND('C', 0)
 
 // sent by Raspberry PI to perform last actions before shutting down
-#define SHUTDOWN_CMD "S"
+#define SHUTDOWN_CMD B3_COMMAND('S', 0)
 
 #define DELAY_100_MS 100
 
+// LED patterns: toggle_leds() blink period, b3_shutdown() chase step
+#define TOGGLE_LEDS_PERIOD_MS (DELAY_100_MS * 10)
+#define SHUTDOWN_LEDS_STEP_MS (DELAY_100_MS * 2)
+
 // sent by RPI to reset the Arduino
-#define RESET_CMD "R"
+#define RESET_CMD B3_COMMAND('R', 0)
+
+// sent by RPI to get the controls statistics, answered with a SysEx message:
+// F0 7D 43 01 <pedal CC triplets sent> <pedal CC triplets suppressed> F7
+// each count is sent as 3 bytes of 7 bits, LSB first, saturated at 2^21 - 1
+#define STATS_CMD B3_COMMAND('S', 'T')
+
+// sent by RPI to select the expression pedal curve: "PC" followed by one of
+// exprPedalCurve, e.g. "PC1" for the audio taper curve
+#define PEDAL_CURVE_CMD B3_COMMAND('P', 'C')
 
-#define NEW_LINE '\n'
+// sent by RPI to upload the user curve, one point at a time: "PP" followed by
+// the point index and its 14-bit value, e.g. "PP16 4096" (see b3_pedal_curves.h)
+#define USER_CURVE_POINT_CMD B3_COMMAND('P', 'P')
+
+#define CONTROLS_SYSEX_DEVICE_ID 0x43  // 'C'
+#define CONTROLS_SYSEX_STATS 0x01
 
 // --------------------------- pins assignments -------------------------------
 
@@ -59,12 +102,86 @@ extern const int PERC_HARM_LED;
 extern const int EXPR_PEDAL;
 extern const int LESLIE;
 
+#define NB_PANEL_LEDS 7
+
+// control panel LEDs, in the order of their indexes: all LEDs writes and
+// patterns go through it (see B3Leds.h)
+extern B3Leds panel_leds;
+
+// vibrato/chorus rotary switch positions
+#define VC_FIRST_PIN 6   // D6
+#define VC_LAST_PIN 11   // D11
+
+// --------------------------- switches debouncing ----------------------------
+//
+// The panel switches (buttons and vibrato/chorus rotary switch positions) are
+// sampled together every CTRL_DEBOUNCE_TICK_MS into a word of one bit per
+// switch, with one VPORT read per port. A switch takes a new state once
+// CTRL_DEBOUNCE_SAMPLES consecutive samples differ from its debounced state:
+// each switch has a 3-bit counter of these samples, bit-sliced over three
+// words so that all the switches are counted at once, and a bounce resets it.
+// Response time: CTRL_DEBOUNCE_SAMPLES * CTRL_DEBOUNCE_TICK_MS.
+//
+// The switches are only sampled while there is something to debounce: both
+// edges of every panel switch raise a PORT interrupt which marks it pending.
+// A pending edge on a quiet panel is sampled at once by loop(), then the
+// switches are sampled every CTRL_DEBOUNCE_TICK_MS until they are stable
+// again; they are also sampled on every refresh tick, should an edge be
+// missed. The PORTx_PORT_vect interrupts are defined here: attachInterrupt()
+// must not be used in this firmware.
+//
+// Can be changed from platformio.ini: build_flags = -D CTRL_DEBOUNCE_SAMPLES=6
+#ifndef CTRL_DEBOUNCE_SAMPLES
+#define CTRL_DEBOUNCE_SAMPLES 4
+#endif
+
+#if CTRL_DEBOUNCE_SAMPLES < 1 || CTRL_DEBOUNCE_SAMPLES > 7
+#error "CTRL_DEBOUNCE_SAMPLES must be in the [1..7] range"
+#endif
+
+#define CTRL_DEBOUNCE_TICK_MS 1
+
+#define NB_PANEL_SWITCHES 13
+
 
 /*
 * Sets pins mode (input, output, pull-up...)
 */
 void setup_ctrl_pins(void);
 
+/*
+* Reads all the panel switches, one bit per switch in the panel_switches
+* table order. Direct VPORT reads on the ATmega4809.
+*/
+uint16_t read_panel_switches(void);
+
+/*
+* Sets the debounced panel switches state to their current state and enables
+* the panel switches pin change interrupts.
+*/
+void init_panel_switches(void);
+
+/*
+* True while a panel switch is pending (edge not sampled yet) or bouncing
+* (count of differing samples not back to 0).
+*/
+bool is_panel_switch_pending(void);
+bool is_panel_switch_bouncing(void);
+
+/*
+* Samples the panel switches and updates their debounced state; clears the
+* pending edges. Called on edges and every CTRL_DEBOUNCE_TICK_MS while bouncing.
+*/
+void debounce_panel_switches(void);
+
+/*
+* Debounced level of a panel switch.
+*
+* @param int pin - panel switch pin (example: OVERDRIVE_SWITCH)
+* @return HIGH or LOW
+*/
+bool get_switch_state(int pin);
+
 /*
 * When the organ is turned on, we want setBfree parameters to be set to initial
 * hardware controls settings, therefore we have to send the corresponding MIDI
@@ -76,10 +193,11 @@ void set_controls_initial_state(void);
 
 /*
 * Toggles one or all LEDs of the control panel. All LEDs are toggled if the
-* led_idx parameter is not provided.
+* led_idx parameter is not provided. Returns at once: the LEDs blink while
+* loop() runs and are then back to their state.
 *
 * @param int nbToggles - number of times we want the LEDs to toggle
-* @param int led_idx - index of LED to be toggled (example: OVERDRIVE_LED)
+* @param int led_idx - index of LED to be toggled in panel_leds (0 for OVERDRIVE_LED)
 */
 void toggle_leds(int nb_toggles, int led_idx = -1);
 
@@ -92,6 +210,7 @@ void set_overdrive(bool on);
 
 /*
 * B3 control panel switch toggle detection with button LED control.
+* The switch debounced state is used (see debounce_panel_switches()).
 * 
 * @param b3_switch - index of a control panel switch (example: OVERDRIVE_SWITCH)
 * @param set_b3_control - pointer to the function which performs the changes (control LED toggle and MIDI message sending)
@@ -111,21 +230,31 @@ void on_overdrive_change(void);
 void on_leslie_change(void);
 
 /*
-* Expression pedal change detection.
-* Modifies the volume of upper, lower and pedals.
+* Expression pedal change detection: measures and filters the pedal position.
+* Modifies the volume of upper, lower and pedals. Pedal position changes which
+* are not sent (not significant or held by the rate limit) are counted.
 */
 void on_expression_pedal_change(void);
 
 /*
 * Discards spurious MIDI messages sent to setBfree by filtering out
-* non significant analog measure variations.
+* non significant analog measure variations: compares the filtered pedal
+* measure with the one of the position last sent (see EXPR_PEDAL_HYSTERESIS).
 *
 * @return true if the pedal position was moved enough to produce a valid change
 */
 bool is_expression_pedal_change_significant(void);
 
 /*
-* Given an expression pedal analog value, returns a pedal position value.
+* Sends the STATS_CMD answer: number of expression pedal CC triplets sent and
+* suppressed since power up. A suppressed triplet is a position change which
+* was never sent: rejected by the hysteresis or replaced while rate limited.
+*/
+void send_controls_stats(void);
+
+/*
+* Given an expression pedal analog value, returns a pedal position value
+* on the selected curve (see b3_pedal_curves.h).
 *
 * @return byte - pedal position value
 */
@@ -138,6 +267,13 @@ byte get_expr_pedal_position(int anlgMeasure);
 */
 byte get_leslie_position(int anlgMeasure);
 
+/*
+* Reads the commands sent by the Raspberry PI (RESET_CMD, SHUTDOWN_CMD)
+* without blocking: the bytes received so far are kept until the end of
+* the command line.
+*/
+void on_rpi_cmd(void);
+
 /*
 * Sends a MIDI Program Change message over the USB link.
 * The MIDI channel is always 0.
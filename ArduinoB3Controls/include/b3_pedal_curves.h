@@ -0,0 +1,66 @@
+// ===========================================================================
+// b3_pedal_curves.h
+// expression pedal response curves
+// ===========================================================================
+#ifndef B3_PEDAL_CURVES_H
+#define B3_PEDAL_CURVES_H
+
+#include <Arduino.h>
+
+// A curve maps a 10-bit pedal measure to a 14-bit value; the 7-bit MIDI
+// position is its 7 most significant bits. The built-in curves are computed
+// at compile time and stored in flash: reading one is a single table read.
+// The user curve is made of USER_CURVE_NB_POINTS points kept in EEPROM (every
+// USER_CURVE_STEP measure counts) and interpolated linearly when read.
+enum exprPedalCurve : byte {
+    LINEAR_CURVE,
+    AUDIO_CURVE,  // cubic: 1/8 of the volume at half travel, as an audio taper pot
+    S_CURVE,      // smoothstep: fine control at both ends of the travel
+    USER_CURVE,
+    NB_PEDAL_CURVES
+};
+
+#define PEDAL_CURVE_SIZE 1024
+#define PEDAL_CURVE_MAX 0x3FFF
+
+#define USER_CURVE_STEP 32
+#define USER_CURVE_NB_POINTS (PEDAL_CURVE_SIZE / USER_CURVE_STEP + 1)
+
+// EEPROM address of the pedal curves record, and its identification byte
+#define PEDAL_CURVES_EEPROM_RECORD 0
+#define PEDAL_CURVES_MAGIC 0xC5
+
+
+/*
+* Loads the selected curve and the user curve points from EEPROM. The linear
+* curve and a linear user curve are used if EEPROM holds no valid record.
+*/
+void load_pedal_curves(void);
+
+/*
+* Selects the expression pedal curve; the choice is stored into EEPROM.
+*
+* @param byte curve - one of exprPedalCurve; other values are ignored
+*/
+void select_pedal_curve(byte curve);
+
+byte get_pedal_curve(void);
+
+/*
+* Changes one point of the user curve and stores it into EEPROM.
+*
+* @param long point - [0..USER_CURVE_NB_POINTS - 1], point i is the value of measure i * USER_CURVE_STEP
+* @param long value - [0..PEDAL_CURVE_MAX]
+* @return false if a parameter is out of range
+*/
+bool set_user_curve_point(long point, long value);
+
+/*
+* Given an expression pedal analog value, returns its value on the selected curve.
+*
+* @param int anlgMeasure - 10-bit measure
+* @return uint16_t - [0..PEDAL_CURVE_MAX]
+*/
+uint16_t get_pedal_curve_value(int anlgMeasure);
+
+#endif // B3_PEDAL_CURVES_H
@@ -65,30 +65,89 @@ const int PERC_HARM_LED = 16;         // D16
 const int EXPR_PEDAL = A1;
 const int LESLIE = A0;
 
+const int panel_led_pins[NB_PANEL_LEDS] = {OVERDRIVE_LED, VIBRATO_UPPER_LED, VIBRATO_LOWER_LED, PERC_ON_OFF_LED, PERC_VOLUME_LED, PERC_DELAY_LED, PERC_HARM_LED};
+
+B3Leds panel_leds(panel_led_pins, NB_PANEL_LEDS);
+
+// Panel switches, in the debounced switches word bits order: Arduino pin, and
+// the ATmega4809 port (VPORT) and pin it is wired to on the Nano Every
+enum panelPort : byte { PORT_IDX_A, PORT_IDX_B, PORT_IDX_C, PORT_IDX_D, PORT_IDX_E, PORT_IDX_F, NB_PANEL_PORTS };
+
+struct panelSwitch {
+    byte pin;
+    byte port;  // panelPort
+    byte mask;
+};
+
+constexpr panelSwitch panel_switches[] = {
+    { OVERDRIVE_SWITCH, PORT_IDX_C, PIN5_bm },      // PC5
+    { VIBRATO_UPPER_SWITCH, PORT_IDX_A, PIN0_bm },  // PA0
+    { VIBRATO_LOWER_SWITCH, PORT_IDX_C, PIN6_bm },  // PC6
+    { PERC_ON_OFF_SWITCH, PORT_IDX_E, PIN2_bm },    // PE2
+    { PERC_VOLUME_SWITCH, PORT_IDX_D, PIN4_bm },    // PD4
+    { PERC_DELAY_SWITCH, PORT_IDX_F, PIN2_bm },     // PF2
+    { PERC_HARM_SEL_SWITCH, PORT_IDX_D, PIN0_bm },  // PD0
+    { 6, PORT_IDX_F, PIN4_bm },                     // vibrato/chorus D6 = PF4
+    { 7, PORT_IDX_A, PIN1_bm },                     //                D7 = PA1
+    { 8, PORT_IDX_E, PIN3_bm },                     //                D8 = PE3
+    { 9, PORT_IDX_B, PIN0_bm },                     //                D9 = PB0
+    { 10, PORT_IDX_B, PIN1_bm },                    //               D10 = PB1
+    { 11, PORT_IDX_E, PIN0_bm }                     //               D11 = PE0
+};
+
+static_assert(sizeof(panel_switches) / sizeof(panel_switches[0]) == NB_PANEL_SWITCHES, "one row per panel switch");
+
+// debounced panel switches, one bit per panel_switches row, and the bit-sliced
+// counters of the consecutive samples differing from it
+uint16_t switches_state;
+uint16_t bounce_cnt0, bounce_cnt1, bounce_cnt2;
+
+// debounced switches state as last seen by on_control_change()
+uint16_t switches_seen;
+
+// panel switches with an edge not sampled yet (written by the PORT interrupts)
+volatile uint16_t pending_switches = 0;
+
+// expression pedal state: filtered measure (EXPR_PEDAL_OVERSAMPLING accumulated
+// measures times 2^EXPR_PEDAL_EMA_SHIFT, 0 before the first one) and the
+// position it gives, the position and the filtered measure last sent and when,
+// and whether a significant change waits for the rate limit
+static_assert(1023UL * EXPR_PEDAL_OVERSAMPLING << EXPR_PEDAL_EMA_SHIFT <= 0xFFFF, "filtered pedal measure fits 16 bits");
+
+uint16_t expr_pedal_filtered = 0;
+byte expr_pedal_position;
+byte expr_pedal_sent = EXPR_PEDAL_NONE;
+uint16_t expr_pedal_sent_filtered;
+unsigned long expr_pedal_sent_ms;
+bool expr_pedal_pending = false;
+
+// statistics: expression pedal CC triplets sent and suppressed; a position
+// which is not sent is counted once, when the pedal leaves it for another
+// unsent position (back on the sent position, nothing is lost)
+unsigned long expr_pedal_triplets_sent = 0;
+unsigned long expr_pedal_triplets_suppressed = 0;
+byte expr_pedal_unsent = EXPR_PEDAL_NONE;
+
 
 // Allows resetting the Arduino programmatically on reception of RESET_CMD.
 void (*reset_func)(void) = 0;
 
+// commands received from the Raspberry PI
+B3Command rpi_cmd(Serial);
+
 /*
   Uses the organ control panel LEDs to confirm we are shutting down.
   Ensures all LEDs are switched off on shutdown.
 */
 void b3_shutdown(void) {
 
-    const int NB_LEDS = 7;
-    const int leds[NB_LEDS] = {OVERDRIVE_LED, VIBRATO_UPPER_LED, VIBRATO_LOWER_LED, PERC_ON_OFF_LED, PERC_VOLUME_LED, PERC_DELAY_LED, PERC_HARM_LED};
-
     // First, switch off all LEDs.
-    for (int i = 0; i < NB_LEDS; i++) {
-        digitalWrite(leds[i], OFF);
+    for (int i = 0; i < NB_PANEL_LEDS; i++) {
+        panel_leds.write(panel_led_pins[i], OFF);
     }
 
-    // Then, switch them on and off sequentially.
-    for (int i = 0; i < NB_LEDS; i++) {
-        digitalWrite(leds[i], ON);
-        delay(DELAY_100_MS * 2);
-        digitalWrite(leds[i], ON);
-    }
+    // Then, switch them on and off sequentially; all off when done.
+    panel_leds.chase(B3_LEDS_ALL, SHUTDOWN_LEDS_STEP_MS, 1);
 }
 
 /*
@@ -97,8 +156,10 @@ void b3_shutdown(void) {
 */
 void setup() {
 
-    // keep controls alive
-    sleep_disable();
+    // loop() sleeps until the next interrupt (pin change, serial link or the
+    // millis() timer); the idle mode keeps the timers and the serial link running
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
 
     setup_ctrl_pins();
 
@@ -109,14 +170,14 @@ void setup() {
     // this is a documented issue with the ATmega chips.
     analogRead(LESLIE);
 
+    load_pedal_curves();
+
     // wait for Raspberry PI connections
-    // any character received from the RPI exits the loop
-    while (!Serial.available())
+    // the first command received from the RPI exits the loop
+    while (!rpi_cmd.poll())
         delay(DELAY_100_MS);
 
-    String id = Serial.readStringUntil(NEW_LINE);
-
-    if (id.equals(CONTROLS_IDENTIFIER)) {
+    if (rpi_cmd.code() == CONTROLS_IDENTIFIER) {
 
         set_controls_initial_state();
         toggle_leds(2);
@@ -153,6 +214,132 @@ void setup_ctrl_pins(void) {
     // analog inputs
     pinMode(LESLIE, INPUT);
     pinMode(EXPR_PEDAL, INPUT);
+
+    init_panel_switches();
+}
+
+
+uint16_t read_panel_switches(void) {
+
+    const byte in[NB_PANEL_PORTS] = { VPORTA.IN, VPORTB.IN, VPORTC.IN, VPORTD.IN, VPORTE.IN, VPORTF.IN };
+
+    uint16_t switches = 0;
+
+    for (int i = 0; i < NB_PANEL_SWITCHES; i++) {
+        if (in[panel_switches[i].port] & panel_switches[i].mask)
+            switches |= 1U << i;
+    }
+
+    return switches;
+}
+
+
+void init_panel_switches(void) {
+
+    PORT_t* const ports[NB_PANEL_PORTS] = { &PORTA, &PORTB, &PORTC, &PORTD, &PORTE, &PORTF };
+
+    switches_state = read_panel_switches();
+    switches_seen = switches_state;
+    bounce_cnt0 = bounce_cnt1 = bounce_cnt2 = 0;
+
+    // both edges interrupts, pull-up setting left as set by pinMode()
+    for (int i = 0; i < NB_PANEL_SWITCHES; i++) {
+
+        volatile uint8_t* pin_ctrl = &ports[panel_switches[i].port]->PIN0CTRL;
+
+        for (int pin = 0; pin < 8; pin++) {
+            if (panel_switches[i].mask == (1 << pin))
+                pin_ctrl[pin] = (pin_ctrl[pin] & ~PORT_ISC_gm) | PORT_ISC_BOTHEDGES_gc;
+        }
+    }
+
+    pending_switches = 0;
+}
+
+
+/*
+  Marks the panel switches of a port which had an edge as pending.
+  Called from the PORT interrupts.
+*/
+static void on_port_edges(byte port, byte flags) {
+
+    for (int i = 0; i < NB_PANEL_SWITCHES; i++) {
+        if (panel_switches[i].port == port && (flags & panel_switches[i].mask))
+            pending_switches |= 1U << i;
+    }
+}
+
+
+// writing the flags back clears them
+ISR(PORTA_PORT_vect) { byte flags = VPORTA.INTFLAGS; VPORTA.INTFLAGS = flags; on_port_edges(PORT_IDX_A, flags); }
+ISR(PORTB_PORT_vect) { byte flags = VPORTB.INTFLAGS; VPORTB.INTFLAGS = flags; on_port_edges(PORT_IDX_B, flags); }
+ISR(PORTC_PORT_vect) { byte flags = VPORTC.INTFLAGS; VPORTC.INTFLAGS = flags; on_port_edges(PORT_IDX_C, flags); }
+ISR(PORTD_PORT_vect) { byte flags = VPORTD.INTFLAGS; VPORTD.INTFLAGS = flags; on_port_edges(PORT_IDX_D, flags); }
+ISR(PORTE_PORT_vect) { byte flags = VPORTE.INTFLAGS; VPORTE.INTFLAGS = flags; on_port_edges(PORT_IDX_E, flags); }
+ISR(PORTF_PORT_vect) { byte flags = VPORTF.INTFLAGS; VPORTF.INTFLAGS = flags; on_port_edges(PORT_IDX_F, flags); }
+
+
+bool is_panel_switch_pending(void) {
+
+    noInterrupts();
+    bool pending = pending_switches != 0;
+    interrupts();
+
+    return pending;
+}
+
+
+bool is_panel_switch_bouncing(void) {
+
+    return (bounce_cnt0 | bounce_cnt1 | bounce_cnt2) != 0;
+}
+
+
+void debounce_panel_switches(void) {
+
+    // edges from now on are sampled next time
+    noInterrupts();
+    pending_switches = 0;
+    interrupts();
+
+    uint16_t delta = read_panel_switches() ^ switches_state;
+
+    // one more differing sample; back to 0 where the sample matches
+    uint16_t cnt2 = (bounce_cnt2 ^ (bounce_cnt1 & bounce_cnt0)) & delta;
+    uint16_t cnt1 = (bounce_cnt1 ^ bounce_cnt0) & delta;
+    uint16_t cnt0 = ~bounce_cnt0 & delta;
+
+    // switches whose count has reached CTRL_DEBOUNCE_SAMPLES
+    uint16_t stable = delta
+        & (CTRL_DEBOUNCE_SAMPLES & 1 ? cnt0 : ~cnt0)
+        & (CTRL_DEBOUNCE_SAMPLES & 2 ? cnt1 : ~cnt1)
+        & (CTRL_DEBOUNCE_SAMPLES & 4 ? cnt2 : ~cnt2);
+
+    switches_state ^= stable;
+
+    bounce_cnt0 = cnt0 & ~stable;
+    bounce_cnt1 = cnt1 & ~stable;
+    bounce_cnt2 = cnt2 & ~stable;
+}
+
+
+/*
+  Bit of a panel switch in the debounced switches word, 0 if pin is not a panel switch.
+*/
+static uint16_t get_switch_mask(int pin) {
+
+    for (int i = 0; i < NB_PANEL_SWITCHES; i++) {
+        if (panel_switches[i].pin == pin)
+            return 1U << i;
+    }
+
+    return 0;
+}
+
+
+bool get_switch_state(int pin) {
+
+    return (switches_state & get_switch_mask(pin)) ? HIGH : LOW;
 }
 
 void set_controls_initial_state() {
@@ -176,13 +363,39 @@ void set_controls_initial_state() {
 */
 void on_rpi_cmd()
 {
-    if (Serial.available() == 2) {
-        String cmd = Serial.readStringUntil(NEW_LINE);
+    if (!rpi_cmd.poll())
+        return;
 
-        if (cmd.equals(RESET_CMD))
+    switch (rpi_cmd.code()) {
+        case RESET_CMD:
             reset_func();
-        else if (cmd.equals(SHUTDOWN_CMD))
+            break;
+        case STATS_CMD:
+            send_controls_stats();
+            break;
+        case PEDAL_CURVE_CMD: {
+            char* end;
+            long curve = strtol(rpi_cmd.args(), &end, 10);
+            if (end != rpi_cmd.args() && *end == '\0' && curve >= 0 && curve < NB_PEDAL_CURVES) {
+                select_pedal_curve(curve);
+                // the pedal has not moved: sent even if not significant
+                expr_pedal_pending = true;
+            }
+            break;
+        }
+        case USER_CURVE_POINT_CMD: {
+            char* args;
+            char* end;
+            long point = strtol(rpi_cmd.args(), &args, 10);
+            long value = strtol(args, &end, 10);
+            if (args != rpi_cmd.args() && end != args && *end == '\0'
+                    && set_user_curve_point(point, value) && get_pedal_curve() == USER_CURVE)
+                expr_pedal_pending = true;
+            break;
+        }
+        case SHUTDOWN_CMD:
             b3_shutdown();
+            break;
     }
 }
 
@@ -193,10 +406,23 @@ void loop() {
 
     static const unsigned long REFRESH_INTERVAL_MS = 10;
     static unsigned long last_refresh_time = 0;
+    static unsigned long last_debounce_time = 0;
 
-    if (millis() - last_refresh_time >= REFRESH_INTERVAL_MS) {
+    unsigned long now = millis();
+    unsigned long since_sample = now - last_debounce_time;
 
-        last_refresh_time += REFRESH_INTERVAL_MS;
+    bool pending = is_panel_switch_pending();
+    bool bouncing = is_panel_switch_bouncing();
+
+    // an edge on a quiet panel is sampled at once, a bouncing switch every
+    // CTRL_DEBOUNCE_TICK_MS (no catching up: samples must be a tick apart)
+    if ((pending && !bouncing)
+        || ((pending || bouncing) && since_sample >= CTRL_DEBOUNCE_TICK_MS)
+        || since_sample >= REFRESH_INTERVAL_MS) {
+
+        last_debounce_time = now;
+
+        debounce_panel_switches();
 
         on_control_change(OVERDRIVE_SWITCH, set_overdrive);
         on_control_change(VIBRATO_UPPER_SWITCH, set_vibrato_upper);
@@ -208,57 +434,56 @@ void loop() {
         on_control_change(PERC_VOLUME_SWITCH, set_percussion_volume);
         on_control_change(PERC_DELAY_SWITCH, set_percussion_delay);
         on_control_change(PERC_HARM_SEL_SWITCH, set_percussion_harmonic);
+    }
+
+    if (now - last_refresh_time >= REFRESH_INTERVAL_MS) {
+
+        last_refresh_time += REFRESH_INTERVAL_MS;
 
         on_leslie_change();
         on_expression_pedal_change();
 
         on_rpi_cmd();
     }
+
+    panel_leds.update();
+
+    // woken up by the millis() timer at the latest; an edge arriving after
+    // the pending switches were checked waits at most one tick
+    sleep_cpu();
 }
 
 
 void on_control_change(int b3_switch, void (*set_b3_control)(bool)) {
 
-    // Control pins are in the D0-D20 range
-    constexpr int ARRAY_SIZE = 21;
+    static uint16_t switches_on = 0;
 
-    static bool s_old[ARRAY_SIZE];
-    static bool s_new[ARRAY_SIZE];
-    static bool s_on[ARRAY_SIZE];
+    uint16_t mask = get_switch_mask(b3_switch);
+    uint16_t changed = (switches_state ^ switches_seen) & mask;
 
-    static bool initialized = false;
-    if (!initialized) {
-        for (int i = 0; i < ARRAY_SIZE; ++i) {
-            s_old[i] = LOW;
-            s_new[i] = LOW;
-            s_on[i] = false;
-        }
-        initialized = true;
-    }
+    if (changed) {
+        switches_seen ^= changed;
 
-    s_new[b3_switch] = digitalRead(b3_switch);
-
-    if (s_new[b3_switch] != s_old[b3_switch]) {
-        if (s_new[b3_switch] == LOW) {
-            s_on[b3_switch] = !s_on[b3_switch];
-            set_b3_control(s_on[b3_switch]);
+        // pressed
+        if (!(switches_state & mask)) {
+            switches_on ^= mask;
+            set_b3_control(switches_on & mask);
         }
-        s_old[b3_switch] = s_new[b3_switch];
     }
 }
 
 void set_overdrive(bool on) {
-    digitalWrite(OVERDRIVE_LED, on);
+    panel_leds.write(OVERDRIVE_LED, on);
     on ? send_program_change(OVERDRIVE_ON) : send_program_change(OVERDRIVE_OFF);
 }
 
 void set_vibrato_upper(bool on) {
-    digitalWrite(VIBRATO_UPPER_LED, on);
+    panel_leds.write(VIBRATO_UPPER_LED, on);
     on ? send_program_change(VIBRATO_UPPER_ON) : send_program_change(VIBRATO_UPPER_OFF);
 }
 
 void set_vibrato_lower(bool on) {
-    digitalWrite(VIBRATO_LOWER_LED, on);
+    panel_leds.write(VIBRATO_LOWER_LED, on);
     on ? send_program_change(VIBRATO_LOWER_ON) : send_program_change(VIBRATO_LOWER_OFF);
 }
 
@@ -266,9 +491,9 @@ void on_vibrato_chorus_change(void) {
     
     static int old_vc_pin = -1;
 
-    for (int vc_pin = 6; vc_pin <= 11; vc_pin++) {
+    for (int vc_pin = VC_FIRST_PIN; vc_pin <= VC_LAST_PIN; vc_pin++) {
 
-        int pin_value = digitalRead(vc_pin);
+        int pin_value = get_switch_state(vc_pin);
 
         if (pin_value == LOW && vc_pin != old_vc_pin) {
 
@@ -300,22 +525,22 @@ void on_vibrato_chorus_change(void) {
 }
 
 void set_percussion(bool on) {
-    digitalWrite(PERC_ON_OFF_LED, on);
+    panel_leds.write(PERC_ON_OFF_LED, on);
     on ? send_program_change(PERCUSSION_ON) : send_program_change(PERCUSSION_OFF);
 }
 
 void set_percussion_volume(bool soft) {
-    digitalWrite(PERC_VOLUME_LED, soft);
+    panel_leds.write(PERC_VOLUME_LED, soft);
     soft ? send_program_change(PERCUSSION_VOLUME_SOFT) : send_program_change(PERCUSSION_VOLUME_NORMAL);
 }
 
 void set_percussion_delay(bool fast) {
-    digitalWrite(PERC_DELAY_LED, fast);
+    panel_leds.write(PERC_DELAY_LED, fast);
     fast ? send_program_change(PERCUSSION_DELAY_FAST) : send_program_change(PERCUSSION_DELAY_SLOW);
 }
 
 void set_percussion_harmonic(bool third) {
-    digitalWrite(PERC_HARM_LED, third);
+    panel_leds.write(PERC_HARM_LED, third);
     third ? send_program_change(PERCUSSION_HARMONIC_3) : send_program_change(PERCUSSION_HARMONIC_2);
 }
 
@@ -349,25 +574,74 @@ byte get_leslie_position(int anlgMeasure) {
 
 void on_expression_pedal_change() {
 
-    static byte expr_pedal_old;
-    static byte expr_pedal_new;
+    // accumulated measure; the Leslie switch is read without accumulation
+    ADC0.CTRLB = EXPR_PEDAL_SAMPNUM;
+    uint16_t anlgMeasure = analogRead(EXPR_PEDAL);
+    ADC0.CTRLB = ADC_SAMPNUM_ACC1_gc;
 
-    int anlgMeasure = analogRead(EXPR_PEDAL);
-    expr_pedal_new = get_expr_pedal_position(anlgMeasure);
+    uint16_t filtered = expr_pedal_filtered;
+    expr_pedal_filtered = filtered == 0
+        ? anlgMeasure << EXPR_PEDAL_EMA_SHIFT
+        : filtered + anlgMeasure - (filtered >> EXPR_PEDAL_EMA_SHIFT);
 
-    if (expr_pedal_new != expr_pedal_old) {
+    expr_pedal_position = get_expr_pedal_position(expr_pedal_filtered / (EXPR_PEDAL_OVERSAMPLING << EXPR_PEDAL_EMA_SHIFT));
 
-        send_control_change(UPPER_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_new);
-        send_control_change(LOWER_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_new);
-        send_control_change(PEDAL_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_new);
+    if (expr_pedal_position == expr_pedal_sent) {
+        expr_pedal_pending = false;  // back where it was
+        expr_pedal_unsent = EXPR_PEDAL_NONE;
+        return;
+    }
 
-        expr_pedal_old = expr_pedal_new;
+    if (expr_pedal_position != expr_pedal_unsent) {
+        if (expr_pedal_unsent != EXPR_PEDAL_NONE)
+            expr_pedal_triplets_suppressed++;
+        expr_pedal_unsent = expr_pedal_position;
     }
+
+    if (!expr_pedal_pending && !is_expression_pedal_change_significant())
+        return;
+
+    expr_pedal_pending = true;
+
+    unsigned long now = millis();
+
+    if (expr_pedal_sent != EXPR_PEDAL_NONE && now - expr_pedal_sent_ms < EXPR_PEDAL_CC_INTERVAL_MS)
+        return;
+
+    send_control_change(UPPER_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_position);
+    send_control_change(LOWER_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_position);
+    send_control_change(PEDAL_MIDI_CHNL, VOLUME_CONTROL, expr_pedal_position);
+
+    expr_pedal_sent = expr_pedal_position;
+    expr_pedal_sent_filtered = expr_pedal_filtered;
+    expr_pedal_sent_ms = now;
+    expr_pedal_pending = false;
+    expr_pedal_unsent = EXPR_PEDAL_NONE;
+    expr_pedal_triplets_sent++;
+}
+
+bool is_expression_pedal_change_significant(void) {
+
+    if (expr_pedal_sent == EXPR_PEDAL_NONE)
+        return true;
+
+    if (expr_pedal_position == expr_pedal_sent)
+        return false;
+
+    // the ends of the pedal travel are always reached
+    if (expr_pedal_position == 0 || expr_pedal_position == 127)
+        return true;
+
+    uint16_t moved = expr_pedal_filtered > expr_pedal_sent_filtered
+        ? expr_pedal_filtered - expr_pedal_sent_filtered
+        : expr_pedal_sent_filtered - expr_pedal_filtered;
+
+    return moved >= (EXPR_PEDAL_HYSTERESIS * EXPR_PEDAL_OVERSAMPLING) << EXPR_PEDAL_EMA_SHIFT;
 }
 
 byte get_expr_pedal_position(int anlgMeasure) {
 
-    byte position = anlgMeasure / 8;
+    byte position = get_pedal_curve_value(anlgMeasure) >> 7;
     return position;
 }
 
@@ -380,6 +654,18 @@ void send_control_change(byte channel, byte control, byte value) {
     Serial.write(bytes, 3);
 }
 
+void send_controls_stats(void) {
+
+    byte bytes[11];
+    bytes[0] = SYSEX_START;
+    bytes[1] = SYSEX_NON_COMMERCIAL_ID;
+    bytes[2] = CONTROLS_SYSEX_DEVICE_ID;
+    bytes[3] = CONTROLS_SYSEX_STATS;
+    putSysExCount(putSysExCount(&bytes[4], expr_pedal_triplets_sent), expr_pedal_triplets_suppressed);
+    bytes[10] = SYSEX_END;
+    Serial.write(bytes, sizeof(bytes));
+}
+
 void send_program_change(byte program) {
 
     byte bytes[2];
@@ -388,23 +674,12 @@ void send_program_change(byte program) {
     Serial.write(bytes, 2);
 }
 
-void toggle_leds(int nb_toggles, int led_idx = -1) {
-
-    const int NB_LEDS = 7;
-    const int leds[NB_LEDS] = {OVERDRIVE_LED, VIBRATO_UPPER_LED, VIBRATO_LOWER_LED, PERC_ON_OFF_LED, PERC_VOLUME_LED, PERC_DELAY_LED, PERC_HARM_LED};
-
-    for (int t = 0; t < 2 * nb_toggles; t++) {
+void toggle_leds(int nb_toggles, int led_idx) {
 
-        if (led_idx == -1) {
-            // toggle ALL LEDs
-            for (int d = 0; d < NB_LEDS; d++)
-                t % 2 ? digitalWrite(leds[d], OFF) : digitalWrite(leds[d], ON);
-        }
-        else {
-            // toggle a SINGLE LED
-            t % 2 ? digitalWrite(leds[led_idx], OFF) : digitalWrite(leds[led_idx], ON);
-        }
+    if (led_idx >= NB_PANEL_LEDS || nb_toggles <= 0)
+        return;
 
-        delay(DELAY_100_MS * 5);
-    }
+    // toggle ALL LEDs or a SINGLE LED
+    byte leds = led_idx == -1 ? B3_LEDS_ALL : bit(led_idx);
+    panel_leds.blink(leds, TOGGLE_LEDS_PERIOD_MS, min(nb_toggles, 0xFF));
 }
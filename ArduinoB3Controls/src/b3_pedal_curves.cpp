@@ -0,0 +1,128 @@
+#include "b3_pedal_curves.h"
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#define MEASURE_MAX (PEDAL_CURVE_SIZE - 1)
+
+// ------------------------- built-in curves (flash) --------------------------
+
+constexpr uint16_t linear_value(unsigned long long m) {
+    return m * PEDAL_CURVE_MAX / MEASURE_MAX;
+}
+
+constexpr uint16_t audio_value(unsigned long long m) {
+    return m * m * m * PEDAL_CURVE_MAX / ((unsigned long long)MEASURE_MAX * MEASURE_MAX * MEASURE_MAX);
+}
+
+// 3 m^2 - 2 m^3, m in [0..1]
+constexpr uint16_t s_value(unsigned long long m) {
+    return (3 * m * m * MEASURE_MAX - 2 * m * m * m) * PEDAL_CURVE_MAX
+        / ((unsigned long long)MEASURE_MAX * MEASURE_MAX * MEASURE_MAX);
+}
+
+#define CURVE_4(f, m) f(m), f(m + 1), f(m + 2), f(m + 3)
+#define CURVE_16(f, m) CURVE_4(f, m), CURVE_4(f, m + 4), CURVE_4(f, m + 8), CURVE_4(f, m + 12)
+#define CURVE_64(f, m) CURVE_16(f, m), CURVE_16(f, m + 16), CURVE_16(f, m + 32), CURVE_16(f, m + 48)
+#define CURVE_256(f, m) CURVE_64(f, m), CURVE_64(f, m + 64), CURVE_64(f, m + 128), CURVE_64(f, m + 192)
+#define CURVE_1024(f) CURVE_256(f, 0), CURVE_256(f, 256), CURVE_256(f, 512), CURVE_256(f, 768)
+
+// indexed by exprPedalCurve, USER_CURVE excepted
+static const uint16_t builtin_curves[USER_CURVE][PEDAL_CURVE_SIZE] PROGMEM = {
+    { CURVE_1024(linear_value) },
+    { CURVE_1024(audio_value) },
+    { CURVE_1024(s_value) }
+};
+
+static_assert(audio_value(MEASURE_MAX) == PEDAL_CURVE_MAX && s_value(MEASURE_MAX) == PEDAL_CURVE_MAX, "curves end at PEDAL_CURVE_MAX");
+
+// ------------------------------ user curve ----------------------------------
+
+// selected curve and user curve points, as stored in EEPROM
+struct pedalCurvesRecord {
+    byte magic;
+    byte curve;
+    uint16_t points[USER_CURVE_NB_POINTS];
+    byte checksum;
+};
+
+pedalCurvesRecord curves_record;
+
+static byte record_checksum(void) {
+
+    const byte* data = (const byte*)&curves_record;
+    byte sum = 0;
+
+    for (size_t i = 0; i < offsetof(pedalCurvesRecord, checksum); i++)
+        sum += data[i];
+
+    return ~sum;
+}
+
+static void store_record(void) {
+
+    curves_record.checksum = record_checksum();
+    eeprom_update_block(&curves_record, (void*)PEDAL_CURVES_EEPROM_RECORD, sizeof(curves_record));
+}
+
+/*
+  User curve value of a measure: linear interpolation between the points.
+*/
+static uint16_t user_curve_value(int anlgMeasure) {
+
+    int point = anlgMeasure / USER_CURVE_STEP;
+    long from = curves_record.points[point];
+    long to = curves_record.points[point + 1];
+
+    return from + (to - from) * (anlgMeasure % USER_CURVE_STEP) / USER_CURVE_STEP;
+}
+
+void load_pedal_curves(void) {
+
+    eeprom_read_block(&curves_record, (const void*)PEDAL_CURVES_EEPROM_RECORD, sizeof(curves_record));
+
+    if (curves_record.magic != PEDAL_CURVES_MAGIC || curves_record.checksum != record_checksum()
+        || curves_record.curve >= NB_PEDAL_CURVES) {
+
+        curves_record.magic = PEDAL_CURVES_MAGIC;
+        curves_record.curve = LINEAR_CURVE;
+
+        for (int i = 0; i < USER_CURVE_NB_POINTS; i++)
+            curves_record.points[i] = min((unsigned long)i * USER_CURVE_STEP * PEDAL_CURVE_MAX / MEASURE_MAX, PEDAL_CURVE_MAX);
+    }
+}
+
+void select_pedal_curve(byte curve) {
+
+    if (curve >= NB_PEDAL_CURVES)
+        return;
+
+    curves_record.curve = curve;
+    store_record();
+}
+
+byte get_pedal_curve(void) {
+
+    return curves_record.curve;
+}
+
+bool set_user_curve_point(long point, long value) {
+
+    if (point < 0 || point >= USER_CURVE_NB_POINTS || value < 0 || value > PEDAL_CURVE_MAX)
+        return false;
+
+    curves_record.points[point] = value;
+    store_record();
+
+    return true;
+}
+
+uint16_t get_pedal_curve_value(int anlgMeasure) {
+
+    anlgMeasure = constrain(anlgMeasure, 0, MEASURE_MAX);
+
+    if (curves_record.curve == USER_CURVE)
+        return user_curve_value(anlgMeasure);
+
+    return pgm_read_word(&builtin_curves[curves_record.curve][anlgMeasure]);
+}
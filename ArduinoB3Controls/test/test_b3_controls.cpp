@@ -2,6 +2,8 @@
 #include <unity.h>
 #include "b3_controls.h"
 
+extern unsigned long expr_pedal_triplets_suppressed;
+
 
 /*
 * Executed before every test.
@@ -103,6 +105,23 @@ void test_percussion_harmonic_switch_initial_state() {
     TEST_ASSERT_EQUAL(LOW, digitalRead(PERC_HARM_LED));
 }
 
+/*
+  Switches at rest: the debounced state is the read one, after as many
+  samples as needed to accept a change.
+*/
+void test_debounced_switches_initial_state() {
+    for (int i = 0; i < CTRL_DEBOUNCE_SAMPLES; i++)
+        debounce_panel_switches();
+
+    TEST_ASSERT_EQUAL(digitalRead(OVERDRIVE_SWITCH), get_switch_state(OVERDRIVE_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(VIBRATO_UPPER_SWITCH), get_switch_state(VIBRATO_UPPER_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(VIBRATO_LOWER_SWITCH), get_switch_state(VIBRATO_LOWER_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(PERC_ON_OFF_SWITCH), get_switch_state(PERC_ON_OFF_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(PERC_VOLUME_SWITCH), get_switch_state(PERC_VOLUME_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(PERC_DELAY_SWITCH), get_switch_state(PERC_DELAY_SWITCH));
+    TEST_ASSERT_EQUAL(digitalRead(PERC_HARM_SEL_SWITCH), get_switch_state(PERC_HARM_SEL_SWITCH));
+}
+
 /*
   The Leslie switch is a 3-position one: LESLIE_STOP - LESLIE_SLOW, LESLIE_FAST.
   We assume the switch is set to one of them.
@@ -126,6 +145,31 @@ void test_expression_pedal_initial_state() {
     TEST_ASSERT_UINT8_WITHIN (pedal_delta, pedal_expected, expr_pedal_pos);
 }
 
+/*
+  The pedal is not touched while the tests run: once its position is sent,
+  ADC noise alone must not produce another CC triplet.
+*/
+void test_expression_pedal_at_rest() {
+    unsigned long suppressed = expr_pedal_triplets_suppressed;
+    for (int i = 0; i < 50; i++) {
+        on_expression_pedal_change();
+        TEST_ASSERT_FALSE(is_expression_pedal_change_significant());
+    }
+    // a pedal resting on a position boundary is not counted on every read
+    TEST_ASSERT_TRUE(expr_pedal_triplets_suppressed - suppressed <= 1);
+}
+
+void test_pedal_curves_end_points() {
+    byte curve = get_pedal_curve();
+    for (byte c = LINEAR_CURVE; c < USER_CURVE; c++) {
+        select_pedal_curve(c);
+        TEST_ASSERT_EQUAL(0, get_expr_pedal_position(0));
+        TEST_ASSERT_EQUAL(127, get_expr_pedal_position(1023));
+        TEST_ASSERT_TRUE(get_pedal_curve_value(600) >= get_pedal_curve_value(500));
+    }
+    select_pedal_curve(curve);
+}
+
 void test_set_overdrive() {
     set_overdrive(ON);
     TEST_ASSERT_EQUAL(HIGH, digitalRead(OVERDRIVE_LED));
@@ -276,6 +320,64 @@ void test_on_percussion_harmonic_change() {
     TEST_ASSERT_EQUAL(LOW, digitalRead(PERC_HARM_LED));
 }
 
+// ===========================================================================
+//                        LED patterns tests
+// ===========================================================================
+
+void test_toggle_leds_does_not_block() {
+    unsigned long start = millis();
+    toggle_leds(2);
+    TEST_ASSERT_TRUE(millis() - start < DELAY_100_MS);
+    TEST_ASSERT_TRUE(panel_leds.isRunning());
+    TEST_ASSERT_EQUAL(HIGH, digitalRead(OVERDRIVE_LED));
+
+    panel_leds.stop();
+    TEST_ASSERT_FALSE(panel_leds.isRunning());
+}
+
+// ===========================================================================
+//                        Raspberry PI commands reader tests
+// ===========================================================================
+
+/*
+  Stream fed by the tests, a few bytes at a time.
+*/
+class TestStream : public Stream {
+    public:
+        const char* bytes = "";
+        int available() { return strlen(bytes); }
+        int read() { return *bytes ? *bytes++ : -1; }
+        int peek() { return *bytes ? *bytes : -1; }
+        size_t write(uint8_t) { return 1; }
+};
+
+void test_rpi_command_split_line() {
+    TestStream stream;
+    B3Command cmd(stream);
+
+    stream.bytes = "S";
+    TEST_ASSERT_FALSE(cmd.poll());  // no end of line yet: returns at once
+
+    stream.bytes = "\nR\r\n";
+    TEST_ASSERT_TRUE(cmd.poll());
+    TEST_ASSERT_EQUAL_UINT16(SHUTDOWN_CMD, cmd.code());
+
+    TEST_ASSERT_TRUE(cmd.poll());
+    TEST_ASSERT_EQUAL_UINT16(RESET_CMD, cmd.code());
+
+    TEST_ASSERT_FALSE(cmd.poll());
+}
+
+void test_rpi_command_overflow() {
+    TestStream stream;
+    B3Command cmd(stream);
+
+    stream.bytes = "XX0123456789012345678901234567890123456789\nS\n";
+    TEST_ASSERT_TRUE(cmd.poll());
+    TEST_ASSERT_EQUAL_UINT16(SHUTDOWN_CMD, cmd.code());
+    TEST_ASSERT_EQUAL_UINT16(1, cmd.overflows());
+}
+
 int run_unity_tests(void) {
 
     UNITY_BEGIN();
@@ -289,9 +391,12 @@ int run_unity_tests(void) {
     RUN_TEST(test_percussion_volume_switch_initial_state);
     RUN_TEST(test_percussion_delay_switch_initial_state);
     RUN_TEST(test_percussion_harmonic_switch_initial_state);
+    RUN_TEST(test_debounced_switches_initial_state);
 
     RUN_TEST(test_leslie_switch_initial_state);
     RUN_TEST(test_expression_pedal_initial_state);
+    RUN_TEST(test_expression_pedal_at_rest);
+    RUN_TEST(test_pedal_curves_end_points);
 
     RUN_TEST(test_set_overdrive);
     RUN_TEST(test_on_overdrive_change);
@@ -316,6 +421,11 @@ int run_unity_tests(void) {
     RUN_TEST(test_set_percussion_harmonic);
     RUN_TEST(test_on_percussion_harmonic_change);
 
+    RUN_TEST(test_toggle_leds_does_not_block);
+
+    RUN_TEST(test_rpi_command_split_line);
+    RUN_TEST(test_rpi_command_overflow);
+
     return UNITY_END();
 }
 
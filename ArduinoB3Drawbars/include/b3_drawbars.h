@@ -6,6 +6,9 @@
 #define B3_DRAWBARS_H
 
 #include <Arduino.h>
+#include <B3Command.h>
+#include <B3Leds.h>
+#include <B3Midi.h>
 
 // a value out of the possible values range, used to initialize pos_old and pos_new arrays
 // so that whatever the first drawbar position measurement is, we will send a CC message
@@ -14,15 +17,142 @@
 #define NB_DRAWBARS 38  // 4 x 9 + 2
 
 // sent by Raspberry PI to identify the Drawbars board
-#define DRAWBARS_IDENTIFIER "D"
+#define DRAWBARS_IDENTIFIER B3_COMMAND('D', 0)
 
 #define DELAY_10_MS 10
 #define DELAY_100_MS 100
 
+// registration LEDs patterns: toggle_registration_leds() blink period, and
+// pulse period while calibrating
+#define REGISTRATION_LEDS_PERIOD_MS (DELAY_100_MS * 4)
+#define CALIBRATION_LEDS_PERIOD_MS (DELAY_100_MS * 15)
+
+// ADC0 sample length extension, in ADC clock cycles [0..31]: the multiplexers
+// output and the ADC input settle on the newly selected drawbar while the ADC
+// samples it (12 us at the 1 MHz ADC clock set up by the Arduino core)
+#define DRAWBAR_SAMPLEN 10
+
+// ADC0 accumulates DRAWBAR_OVERSAMPLING conversions of each drawbar in hardware
+// (SAMPNUM): a drawbar measure is their sum, [0..1023 * DRAWBAR_OVERSAMPLING].
+// A sweep takes about 38 x 8 x 25 us = 7.6 ms.
+#define DRAWBAR_SAMPNUM ADC_SAMPNUM_ACC8_gc
+#define DRAWBAR_OVERSAMPLING 8
+
+// A drawbar position only changes once its measure is inside the new position
+// window by DRAWBAR_HYSTERESIS (accumulated counts, i.e. 16 counts of a single
+// 10-bit conversion); a drawbar resting on a window boundary stays put.
+#define DRAWBAR_HYSTERESIS (16 * DRAWBAR_OVERSAMPLING)
+
+// Per drawbar calibration: the measures of the end stops, stored in EEPROM on
+// 8 bits (accumulated measure / DRAWBAR_CAL_SCALE). The position windows are
+// spread between them. A drawbar must move over at least DRAWBAR_CAL_MIN_SPAN
+// (accumulated counts) during calibration for its new end stops to be kept.
+#define DRAWBAR_CAL_SCALE 32
+#define DRAWBAR_CAL_MIN_SPAN (512 * DRAWBAR_OVERSAMPLING)
+
+// Drawbars output modes:
+// - STEPPED_MODE: one of the nine dbar_pos[] values, as a real drawbar
+// - CONTINUOUS_MODE: the filtered drawbar measure scaled to [0..127]
+// In CONTINUOUS_MODE, a drawbar value is only sent once it has moved by more
+// than CONTINUOUS_DEADBAND (14-bit units) or reached an end stop.
+enum drawbarsMode : byte {
+    STEPPED_MODE,
+    CONTINUOUS_MODE
+};
+
+// Drawbars output scheduler: the newest position (STEPPED_MODE) or value of a
+// moved drawbar waits in its pending slot, overwritten by the moves to come,
+// until it is sent. A drawbar sends at most one value every
+// DRAWBAR_CC_INTERVAL_MS (see CC_INTERVAL_CMD), and all the drawbars together
+// DRAWBARS_OUTPUT_BYTES_PER_MS on average with bursts of at most
+// DRAWBARS_OUTPUT_BURST_BYTES. A slot is only emptied by sending it: the
+// resting position of a drawbar always reaches setBfree.
+#define DRAWBAR_CC_INTERVAL_MS 20
+#define DRAWBAR_CC_INTERVAL_MAX_MS 1000
+#define DRAWBARS_OUTPUT_BYTES_PER_MS 6  // about half of the 115200 bauds link
+#define DRAWBARS_OUTPUT_BURST_BYTES 60
+
+#define CONTINUOUS_DEADBAND 96  // 3/4 of a 7-bit step
+
+// drawbars MIDI channels and controllers covered by the sent values shadow
+// (see send_control_change()): channels 0..2, controllers 70..78
+#define SHADOW_NB_CHANNELS 3
+#define SHADOW_FIRST_CONTROLLER 70
+#define SHADOW_NB_CONTROLLERS 9
+#define SHADOW_UNKNOWN 0xFF
+
+// EEPROM address of the calibration record, and its identification byte
+#define DRAWBARS_EEPROM_CALIBRATION 0
+#define DRAWBARS_CALIBRATION_MAGIC 0xDB
+
+// Arduino Nano Every pins to ATmega4809 ports mapping of the multiplexers
+// controls: MUX_A = D2 = PA0, MUX_B = D3 = PF5, MUX_C = D4 = PC6
+#define MUX_A_bm PIN0_bm  // VPORTA
+#define MUX_B_bm PIN5_bm  // VPORTF
+#define MUX_C_bm PIN6_bm  // VPORTC
+
 // sent by RPI to reset the Arduino
-#define RESET_CMD "R"
+#define RESET_CMD B3_COMMAND('R', 0)
+
+// sent by RPI to get the drawbars statistics, answered with a SysEx message:
+// F0 7D 44 01 <CC sent> <suppressed changes> <redundant CC skipped> <coalesced values> F7
+// each count is sent as 3 bytes of 7 bits, LSB first, saturated at 2^21 - 1
+#define STATS_CMD B3_COMMAND('S', 0)
+
+// sent by RPI to calibrate the drawbars: on CALIBRATION_START_CMD the player
+// pushes and pulls every drawbar to both end stops (no CC is sent meanwhile),
+// then CALIBRATION_END_CMD stores the new calibration into EEPROM.
+// Drawbars which have not been moved keep their previous calibration.
+// CALIBRATION_CLEAR_CMD goes back to the default breakpoints.
+// The registration LEDs pulse during calibration and flash once it is stored.
+#define CALIBRATION_START_CMD B3_COMMAND('C', 'S')
+#define CALIBRATION_END_CMD B3_COMMAND('C', 'E')
+#define CALIBRATION_CLEAR_CMD B3_COMMAND('C', 'D')
+
+// sent by RPI to select the drawbars output mode (see drawbarsMode)
+#define STEPPED_MODE_CMD B3_COMMAND('M', '0')
+#define CONTINUOUS_MODE_CMD B3_COMMAND('M', '1')
+
+// sent by RPI to change the per drawbar output interval: "PI" followed by a
+// number of ms in [0..DRAWBAR_CC_INTERVAL_MAX_MS], e.g. "PI20"
+#define CC_INTERVAL_CMD B3_COMMAND('P', 'I')
+
+// sent by RPI to stream the drawbars raw measures (see telemetryMode):
+// "T0" stops, "T1<n>" sends the measures of one sweep every n sweeps
+// [1..127], "T2<n>" sends statistics over windows of n sweeps [2..64];
+// without a number, or with something else than a number, n is the default
+// DRAWBARS_TELEMETRY_DECIMATION or DRAWBARS_TELEMETRY_WINDOW
+#define TELEMETRY_OFF_CMD B3_COMMAND('T', '0')
+#define TELEMETRY_RAW_CMD B3_COMMAND('T', '1')
+#define TELEMETRY_SUMMARY_CMD B3_COMMAND('T', '2')
+
+#define DRAWBARS_SYSEX_DEVICE_ID 0x44  // 'D'
+#define DRAWBARS_SYSEX_STATS 0x01
+#define DRAWBARS_SYSEX_RAW 0x02
+#define DRAWBARS_SYSEX_SUMMARY 0x03
+
+// Drawbars telemetry, for noise analysis and filters tuning. Measures are the
+// ADC0 accumulated ones, [0..1023 * DRAWBAR_OVERSAMPLING], sent as 2 bytes of
+// 7 bits, LSB first; the variance as 3 bytes of 7 bits, saturated at 2^21 - 1.
+// - TELEMETRY_RAW: the last measure of every drawbar at the end of a sweep,
+//   DRAWBARS_TELEMETRY_PER_MSG drawbars per message:
+//   F0 7D 44 02 <sweep nb mod 128> <first drawbar idx> <measure>... F7
+// - TELEMETRY_SUMMARY: one message per drawbar at the end of each window:
+//   F0 7D 44 03 <drawbar idx> <window sweeps> <mean> <variance> <min> <max> F7
+// A message is only written once the Serial transmit buffer can take it
+// whole: telemetry never delays the scan loop nor splits a CC message. Sweeps
+// going on while the messages of a frame or window are sent are not counted.
+enum telemetryMode : byte {
+    TELEMETRY_OFF,
+    TELEMETRY_RAW,
+    TELEMETRY_SUMMARY
+};
 
-#define NEW_LINE '\n'
+#define DRAWBARS_TELEMETRY_PER_MSG 19
+#define DRAWBARS_TELEMETRY_DECIMATION 4
+#define DRAWBARS_TELEMETRY_DECIMATION_MAX 127
+#define DRAWBARS_TELEMETRY_WINDOW 32
+#define DRAWBARS_TELEMETRY_WINDOW_MAX 64  // sum of the squared measures fits 32 bits
 
 // used as MIDI channel value in Control Change messages
 struct midiChannel {
@@ -32,39 +162,56 @@ struct midiChannel {
     byte LOWER_B = 1;
     byte BASS = 2;
 };
-midiChannel mc;
+constexpr midiChannel mc = midiChannel();
 
 
-// sent by RPI to Arduino to change drawbars settings
-struct rpiCommand {
-
-    char UPPER_0[3] = "U0";
-    char UPPER_1[3] = "U1";
-    char UPPER_2[3] = "U2";
-    char UPPER_3[3] = "U3";
-    char UPPER_4[3] = "U4";
-    char UPPER_5[3] = "U5";
-    char UPPER_A[3] = "UA";
-    char UPPER_B[3] = "UB";
-    char LOWER_0[3] = "L0";
-    char LOWER_1[3] = "L1";
-    char LOWER_2[3] = "L2";
-    char LOWER_3[3] = "L3";
-    char LOWER_4[3] = "L4";
-    char LOWER_5[3] = "L5";
-    char LOWER_A[3] = "LA";
-    char LOWER_B[3] = "LB";
-    char BASS[2] = "B";
-    byte ETB = 23;  // ASCII End of Transmission Block
+// drawbars registration groups
+enum drawbarsGroup : byte {
+    UPPER_A_GROUP,
+    UPPER_B_GROUP,
+    BASS_GROUP,
+    LOWER_A_GROUP,
+    LOWER_B_GROUP,
+    NB_DRAWBARS_GROUPS
 };
-rpiCommand rc;
 
+// drawbar multiplexer address of the drawbars wired straight to an analog input
+#define NO_MUX 0xFF
 
-// active registrations flags
-bool reg_up_a = true;
-bool reg_up_b = false;
-bool reg_lo_a = true;
-bool reg_lo_b = false;
+// one drawbar of the drawbars boards (see the drawbars table in b3_drawbars.cpp)
+struct drawbarDef {
+    byte anlgIdx;     // analogPins index of the board output
+    byte mux;         // multiplexer address [0..7], or NO_MUX
+    byte channel;     // MIDI channel of its Control Change messages
+    byte controller;  // MIDI controller
+    byte group;       // drawbarsGroup
+};
+
+
+// sent by RPI to Arduino to change drawbars settings
+#define UPPER_0_CMD B3_COMMAND('U', '0')
+#define UPPER_1_CMD B3_COMMAND('U', '1')
+#define UPPER_2_CMD B3_COMMAND('U', '2')
+#define UPPER_3_CMD B3_COMMAND('U', '3')
+#define UPPER_4_CMD B3_COMMAND('U', '4')
+#define UPPER_5_CMD B3_COMMAND('U', '5')
+#define UPPER_A_CMD B3_COMMAND('U', 'A')
+#define UPPER_B_CMD B3_COMMAND('U', 'B')
+#define LOWER_0_CMD B3_COMMAND('L', '0')
+#define LOWER_1_CMD B3_COMMAND('L', '1')
+#define LOWER_2_CMD B3_COMMAND('L', '2')
+#define LOWER_3_CMD B3_COMMAND('L', '3')
+#define LOWER_4_CMD B3_COMMAND('L', '4')
+#define LOWER_5_CMD B3_COMMAND('L', '5')
+#define LOWER_A_CMD B3_COMMAND('L', 'A')
+#define LOWER_B_CMD B3_COMMAND('L', 'B')
+
+// commands received from the Raspberry PI, read by loop() without blocking
+extern B3Command rpi_cmd;
+
+
+// active registrations flags, indexed by drawbarsGroup; bass drawbars are always active
+extern bool reg_active[NB_DRAWBARS_GROUPS];
 
 /*
 * Sets pins mode (input, output, pull-up...)
@@ -84,36 +231,131 @@ void send_drawbars_initial_position(void);
 
 /*
 * Drawbars positions have to be sent to setBfree on initialization as well as
-* on registration change.
+* on registration change, one registration group at a time. They are queued
+* to the output scheduler (see send_pending_drawbars()).
 * On initialization: upper A, lower A and bass drawbars settings are sent.
 * On registration change: only settings of drawbars matching the selected
 * registration are sent.
 *
-* @param preset: preset sent by the RPI
+* @param group: one of drawbarsGroup
 */
-void send_drawbars_positions(String preset);
+void send_group_positions(byte group);
 
 
 /*
   Stores a drawbar position (0..8). It will be compared to the
   previous position to check if the drawbar has been moved.
+  Changes of position within DRAWBAR_HYSTERESIS of a window boundary
+  are suppressed and counted, once per position until the drawbar moves.
+  Called from the ADC0 interrupt.
 
-	anlgMeasure:    analog value measured on the drawbar
+	anlgMeasure:    accumulated analog value measured on the drawbar
 	idx:            index of the drawbar [0..37]
 */
 void store_drawbar_position(int anlgMeasure, int idx);
 
 
 /*
-* Reads active drawbars positions and reacts to changes by sending MIDI Control Change
-* messages to the corresponding MIDI controller.
-* A drawbar is active if it is part of the selected preset (A or B).
+  Loads the drawbars calibration from EEPROM and computes the position windows
+  of each drawbar. Default end stops are used if EEPROM holds no valid record.
+*/
+void load_drawbars_calibration(void);
+
+
+/*
+  Calibration mode (see CALIBRATION_START_CMD): the ADC0 interrupt records the
+  lowest and highest measures of each drawbar until end_drawbars_calibration()
+  computes the new windows and stores them into EEPROM.
+*/
+void start_drawbars_calibration(void);
+void end_drawbars_calibration(void);
+
+
+/*
+  Restores the default end stops of all drawbars and invalidates the EEPROM record.
+*/
+void clear_drawbars_calibration(void);
+
+
+/*
+  Sends the STATS_CMD answer: number of CC messages sent, of drawbar position
+  changes suppressed by the hysteresis, of CC messages skipped because
+  setBfree already had the value and of drawbar values replaced in their
+  pending slot before being sent, since power up.
+*/
+void send_drawbars_stats(void);
+
+
+/*
+  Selects the drawbars telemetry mode (see telemetryMode).
+
+  mode:    one of telemetryMode
+  sweeps:  TELEMETRY_RAW decimation or TELEMETRY_SUMMARY window, in sweeps;
+           invalid values are ignored
+*/
+void set_drawbars_telemetry(byte mode, long sweeps);
+
+
+/*
+  Called on every loop(): collects the raw measures of the new sweeps and
+  sends the telemetry messages the Serial transmit buffer has room for.
+*/
+void send_drawbars_telemetry(void);
+
+
+/*
+* Starts the drawbars scanner: ADC0 converts the drawbars one after the other
+* from its result ready interrupt, which stores the drawbar position, selects
+* the next drawbar (multiplexers and ADC input) and starts its conversion.
+* Sweeps go on forever at the ADC conversion rate (a couple of ms per sweep)
+* without any CPU time spent waiting for the ADC.
+*/
+void start_drawbars_scanner(void);
+
+
+/*
+* Number of full drawbars sweeps completed by the scanner, modulo 256.
+*/
+byte get_drawbars_sweeps(void);
+
+
+/*
+* Called on every loop(): once the scanner has completed a new sweep, compares
+* the drawbars positions with the ones last sent or pending and stores the
+* new ones into the pending slots of the moved drawbars.
+*/
+void send_moved_drawbars_settings(void);
+
+
+/*
+* Output scheduler, called on every loop(): sends the pending drawbars values
+* whose drawbar interval has elapsed, in turn, as long as the output budget
+* and the Serial transmit buffer allow it; never waits.
+* Only active drawbars send CC messages (see is_drawbar_index_in_user_registration_range()).
 */
-void send_active_moved_drawbars_settings();
+void send_pending_drawbars(void);
+
+
+/*
+* Stores the current position or value of a drawbar into its pending slot,
+* whether it has moved or not.
+*
+* @param idx: index of the drawbar in the [0..37] range
+*/
+void queue_drawbar(int idx);
+
+
+/*
+* Sets the minimum interval between two values of the same drawbar.
+*
+* @param interval_ms: [0..DRAWBAR_CC_INTERVAL_MAX_MS], other values are ignored
+*/
+void set_cc_interval(long interval_ms);
 
 
 /*
 * Uses a demultiplexer to select a drawbar for position reading.
+* Direct port writes: called from the ADC0 interrupt.
 *
 * @param mux: multiplex value in [0..7] range
 */
@@ -126,8 +368,28 @@ void select_drawbar(int mux);
 * keyboard registration (excepted for bass).
 *
 * @param idx: index of the moving drawbar in the [0..37] range
+* @param pos: drawbar position [0..8]
 */
-void on_drawbar_move(int idx);
+void on_drawbar_move(int idx, byte pos);
+
+
+/*
+* CONTINUOUS_MODE counterpart of on_drawbar_move(): sends a drawbar value,
+* scaled to 7 bits, if the drawbar is active.
+*
+* @param idx:   index of the moving drawbar in the [0..37] range
+* @param value: 14-bit drawbar value (see get_drawbar_value())
+*/
+void on_drawbar_slide(int idx, uint16_t value);
+
+
+/*
+* Selects the drawbars output mode and queues all the drawbars values in
+* the new mode.
+*
+* @param mode: one of drawbarsMode
+*/
+void set_drawbars_mode(byte mode);
 
 
 /*
@@ -138,9 +400,10 @@ void on_drawbar_move(int idx);
 * Upper [A, B] and Lower [A, B] are user defined presets; when they are
 * selected, we send MIDI Control Change messages to setBfree.
 *
-* @param preset: preset requested by user (one of Upper [A,B, 0..5], Lower [A,B, 0..5])
+* @param preset: code of the preset command requested by user (one of
+*                UPPER_[A,B,0..5]_CMD, LOWER_[A,B,0..5]_CMD)
 */
-void send_user_requested_preset(String preset);
+void send_user_requested_preset(uint16_t preset);
 
 
 /*
@@ -181,6 +444,9 @@ int get_midi_controller(int idx);
 /*
   Sends a MIDI CC message.
   A CC message is sent to setBfree whenever an active drawbar is moved.
+  The last value sent on each drawbar channel and controller is kept: a
+  message which would not change setBfree's value is skipped, so that a
+  registration switch only sends the drawbars which differ.
 
 	channel:    MIDI channel index
 	controller: MIDI controller value
@@ -190,7 +456,15 @@ void send_control_change(byte channel, byte controller, byte value);
 
 
 /*
-* Toggles the A/B drawbars group selection LEDs indicators.
+  Forgets the values sent to setBfree: the next CC messages are all sent.
+  A Program Change makes setBfree load a whole new drawbars setting.
+*/
+void clear_control_change_shadow(void);
+
+
+/*
+* Toggles the A/B drawbars group selection LEDs indicators. Returns at once:
+* the LEDs blink while loop() runs and are then back to their state.
 * @param toggles - number of toggles
 */
 void toggle_registration_leds(int toggles);
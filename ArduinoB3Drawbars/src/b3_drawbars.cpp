@@ -1,5 +1,6 @@
 #include "b3_drawbars.h"
 #include <Arduino.h>
+#include <avr/eeprom.h>
 #include <avr/sleep.h>
 
 /*************************************************************************
@@ -91,19 +92,140 @@ const int MUX_C = 4;  // D4
 const int UP_REG_LED = 5;  // D5
 const int LO_REG_LED = 6;  // D6
 
+const int registration_led_pins[] = {UP_REG_LED, LO_REG_LED};
+B3Leds registration_leds(registration_led_pins, 2);
+
 const int DEBUG_LED = 13;
 
 // analog reading with average calculation
 int analogPins[8] = { A0, A1, A2, A3, A4, A5, A6, A7 };
 
+// ADC0 input (AINx) of the A0..A7 pins of the Arduino Nano Every;
+// A4 and A5 are wired to both PA2/PF2 and PA3/PF3, the analog side is PF2/PF3
+const byte analogMuxPos[8] = { 3, 2, 1, 0, 12, 13, 4, 5 };
+
+// The drawbars boards topology, one row per drawbar in drawbars index order
+// (see the table above). The scanner, the MIDI channel and controller lookups
+// and the registration groups all read this table: a different layout or an
+// additional board only needs new rows (and NB_DRAWBARS).
+#define UPPER_A_DRAWBAR(anlg, mux, ctrl) { anlg, mux, mc.UPPER_A, ctrl, UPPER_A_GROUP }
+#define UPPER_B_DRAWBAR(anlg, mux, ctrl) { anlg, mux, mc.UPPER_B, ctrl, UPPER_B_GROUP }
+#define BASS_DRAWBAR(anlg, mux, ctrl)    { anlg, mux, mc.BASS, ctrl, BASS_GROUP }
+#define LOWER_A_DRAWBAR(anlg, mux, ctrl) { anlg, mux, mc.LOWER_A, ctrl, LOWER_A_GROUP }
+#define LOWER_B_DRAWBAR(anlg, mux, ctrl) { anlg, mux, mc.LOWER_B, ctrl, LOWER_B_GROUP }
+
+constexpr drawbarDef drawbars[] = {
+
+    // Board 1
+    UPPER_A_DRAWBAR(0, 0, 70), UPPER_A_DRAWBAR(0, 1, 71), UPPER_A_DRAWBAR(0, 2, 72),
+    UPPER_A_DRAWBAR(0, 3, 73), UPPER_A_DRAWBAR(0, 4, 74), UPPER_A_DRAWBAR(0, 5, 75),
+    UPPER_A_DRAWBAR(0, 6, 76), UPPER_A_DRAWBAR(0, 7, 77), UPPER_A_DRAWBAR(1, NO_MUX, 78),
+
+    // Board 2
+    UPPER_B_DRAWBAR(2, 0, 70), UPPER_B_DRAWBAR(2, 1, 71), UPPER_B_DRAWBAR(2, 2, 72),
+    UPPER_B_DRAWBAR(2, 3, 73), UPPER_B_DRAWBAR(2, 4, 74), UPPER_B_DRAWBAR(2, 5, 75),
+    UPPER_B_DRAWBAR(2, 6, 76), UPPER_B_DRAWBAR(2, 7, 77), UPPER_B_DRAWBAR(3, 0, 78),
+    BASS_DRAWBAR(3, 1, 70), BASS_DRAWBAR(3, 2, 72),
+
+    // Board 3
+    LOWER_A_DRAWBAR(4, 0, 70), LOWER_A_DRAWBAR(4, 1, 71), LOWER_A_DRAWBAR(4, 2, 72),
+    LOWER_A_DRAWBAR(4, 3, 73), LOWER_A_DRAWBAR(4, 4, 74), LOWER_A_DRAWBAR(4, 5, 75),
+    LOWER_A_DRAWBAR(4, 6, 76), LOWER_A_DRAWBAR(4, 7, 77), LOWER_A_DRAWBAR(5, NO_MUX, 78),
+
+    // Board 4
+    LOWER_B_DRAWBAR(6, 0, 70), LOWER_B_DRAWBAR(6, 1, 71), LOWER_B_DRAWBAR(6, 2, 72),
+    LOWER_B_DRAWBAR(6, 3, 73), LOWER_B_DRAWBAR(6, 4, 74), LOWER_B_DRAWBAR(6, 5, 75),
+    LOWER_B_DRAWBAR(6, 6, 76), LOWER_B_DRAWBAR(6, 7, 77), LOWER_B_DRAWBAR(7, NO_MUX, 78)
+};
+
+static_assert(sizeof(drawbars) / sizeof(drawbars[0]) == NB_DRAWBARS, "one drawbars row per drawbar");
+
 // we have NB_DRAWBARS drawbars and every one has 9 possible positions, which can be coded on one byte
 // we send a MIDI message on initialization, or when a drawbar position has changed
+// pos_new is written by the ADC0 interrupt
 byte pos_old[NB_DRAWBARS];
-byte pos_new[NB_DRAWBARS];
+volatile byte pos_new[NB_DRAWBARS];
+
+// last position rejected by the hysteresis since the drawbar moved, or
+// DRAWBAR_POS_INIT (written by the ADC0 interrupt)
+byte pos_rejected[NB_DRAWBARS];
+
+// full sweeps completed by the ADC0 interrupt
+volatile byte sweeps = 0;
 
 //                    0    1   2   3   4   5   6   7   8
 byte dbar_pos[9] = { 127, 110, 92, 79, 63, 47, 31, 15, 0 };
 
+// Drawbars end stops (8-bit scaled, see DRAWBAR_CAL_SCALE), as stored in EEPROM
+struct calibrationRecord {
+    byte magic;
+    byte lo[NB_DRAWBARS];
+    byte hi[NB_DRAWBARS];
+    byte checksum;
+};
+calibrationRecord calibration;
+
+// lowest accumulated measure of positions 1..8 of each drawbar, computed from
+// its end stops: equal windows, with half windows for positions 0 and 8
+uint16_t dbar_breakpoints[NB_DRAWBARS][8];
+
+// drawbars measures averaged over the last sweeps, times 4 (written by the ADC0
+// interrupt), and the CONTINUOUS_MODE output state: last value sent (14 bits,
+// NO_VALUE before the first one)
+volatile uint16_t dbar_filtered[NB_DRAWBARS];
+#define NO_VALUE 0xFFFF
+uint16_t last_value[NB_DRAWBARS];
+
+// output scheduler state: newest position or value waiting to be sent per
+// drawbar (NO_VALUE when none), when each drawbar last sent, and the minimum
+// interval between two values of a drawbar
+uint16_t pending_value[NB_DRAWBARS];
+uint16_t last_sent_ms[NB_DRAWBARS];
+uint16_t cc_interval_ms = DRAWBAR_CC_INTERVAL_MS;
+
+byte drawbars_mode = STEPPED_MODE;
+
+// last measure of each drawbar (written by the ADC0 interrupt)
+volatile uint16_t dbar_raw[NB_DRAWBARS];
+
+// telemetry state: mode, decimation or window in sweeps, sweeps counted so far,
+// sweep number of the raw frame and next drawbar of the messages being sent
+// (NB_DRAWBARS when none); the raw frame and the summary accumulators share RAM
+byte telemetry_mode = TELEMETRY_OFF;
+byte telemetry_sweeps;
+byte telemetry_count;
+byte telemetry_seq;
+byte telemetry_next = NB_DRAWBARS;
+
+union {
+    uint16_t frame[NB_DRAWBARS];
+    struct {
+        uint32_t sum[NB_DRAWBARS];
+        uint32_t sum_sq[NB_DRAWBARS];
+        uint16_t min[NB_DRAWBARS];
+        uint16_t max[NB_DRAWBARS];
+    } window;
+} telemetry;
+
+// calibration mode: end stops measured so far (written by the ADC0 interrupt)
+volatile bool calibrating = false;
+uint16_t cal_min[NB_DRAWBARS];
+uint16_t cal_max[NB_DRAWBARS];
+
+// statistics: CC messages sent, position changes suppressed by the hysteresis
+// (written by the ADC0 interrupt), values replaced in their pending slot
+unsigned long cc_sent = 0;
+unsigned long cc_skipped = 0;
+volatile unsigned long suppressed_changes = 0;
+unsigned long cc_coalesced = 0;
+
+// last value sent per drawbar channel and controller, SHADOW_UNKNOWN until sent
+byte cc_shadow[SHADOW_NB_CHANNELS][SHADOW_NB_CONTROLLERS];
+
+B3Command rpi_cmd(Serial);
+
+bool reg_active[NB_DRAWBARS_GROUPS] = { true, false, true, true, false };
+
 // allows resetting the Arduino programmatically on reception of RESET_CMD
 void(* reset_func) (void) = 0;
 
@@ -128,15 +250,26 @@ void setup() {
     for (int i = 0; i < NB_DRAWBARS; i++) {
         pos_old[i] = DRAWBAR_POS_INIT;
         pos_new[i] = DRAWBAR_POS_INIT;
+        pos_rejected[i] = DRAWBAR_POS_INIT;
+        dbar_filtered[i] = 0;
+        last_value[i] = NO_VALUE;
+        pending_value[i] = NO_VALUE;
     }
 
-    // wait for Raspberry PI connections; any character received triggers
-    while (! Serial.available())
+    clear_control_change_shadow();
+
+    load_drawbars_calibration();
+    start_drawbars_scanner();
+
+    // all the positions are known before anything is sent
+    while (get_drawbars_sweeps() == 0)
+        ;
+
+    // wait for Raspberry PI connections; the first command received triggers
+    while (! rpi_cmd.poll())
         delay(DELAY_100_MS);
-    
-    String id = Serial.readStringUntil(NEW_LINE);
 
-    if (id.equals(DRAWBARS_IDENTIFIER)) {
+    if (rpi_cmd.code() == DRAWBARS_IDENTIFIER) {
         toggle_registration_leds(2);
         send_drawbars_initial_position();
     }
@@ -179,16 +312,29 @@ void setup_ctrl_pins(void) {
     digitalWrite(MUX_C, LOW);
 
     // switch ON the A registration LEDs for both keyboards
-    digitalWrite(UP_REG_LED, HIGH);
-    digitalWrite(LO_REG_LED, HIGH);
+    registration_leds.write(UP_REG_LED, HIGH);
+    registration_leds.write(LO_REG_LED, HIGH);
 }
 
 
 void send_drawbars_initial_position() {
 
-    send_drawbars_positions(rc.UPPER_A);
-    send_drawbars_positions(rc.LOWER_A);
-    send_drawbars_positions(rc.BASS);
+    send_group_positions(UPPER_A_GROUP);
+    send_group_positions(LOWER_A_GROUP);
+    send_group_positions(BASS_GROUP);
+}
+
+
+/*
+  Returns the numeric argument of the last RPI command, or dflt when it has none
+  or when it is not a number.
+*/
+static long rpi_cmd_arg(long dflt) {
+
+    char* end;
+    long value = strtol(rpi_cmd.args(), &end, 10);
+
+    return end != rpi_cmd.args() && *end == '\0' ? value : dflt;
 }
 
 
@@ -197,393 +343,608 @@ void send_drawbars_initial_position() {
 */
 void loop() {
 
-    static const unsigned long REFRESH_INTERVAL = DELAY_10_MS;
-	static unsigned long last_refresh_time = 0;
+    send_moved_drawbars_settings();
+    send_pending_drawbars();
+    send_drawbars_telemetry();
 
-    if (millis() - last_refresh_time >= REFRESH_INTERVAL)	{
+    registration_leds.update();
 
-		last_refresh_time += REFRESH_INTERVAL;
-    
-        send_active_moved_drawbars_settings();
-        
-        if (Serial.available() > 0) {
+    // never waits for the end of a command line
+    if (! rpi_cmd.poll())
+        return;
 
-            String cmd = Serial.readStringUntil(NEW_LINE);
+    switch (rpi_cmd.code()) {
 
-            if (cmd.equals(RESET_CMD))
-                reset_func();
-            else
-                send_user_requested_preset(cmd);
+        case RESET_CMD:
+            reset_func();
+            break;
+
+        case STATS_CMD:
+            send_drawbars_stats();
+            break;
+
+        case CALIBRATION_START_CMD:
+            start_drawbars_calibration();
+            break;
+
+        case CALIBRATION_END_CMD:
+            end_drawbars_calibration();
+            break;
+
+        case CALIBRATION_CLEAR_CMD:
+            clear_drawbars_calibration();
+            break;
+
+        case STEPPED_MODE_CMD:
+            set_drawbars_mode(STEPPED_MODE);
+            break;
+
+        case CONTINUOUS_MODE_CMD:
+            set_drawbars_mode(CONTINUOUS_MODE);
+            break;
+
+        case TELEMETRY_OFF_CMD:
+            set_drawbars_telemetry(TELEMETRY_OFF, 0);
+            break;
+
+        case TELEMETRY_RAW_CMD:
+            set_drawbars_telemetry(TELEMETRY_RAW, rpi_cmd_arg(DRAWBARS_TELEMETRY_DECIMATION));
+            break;
+
+        case TELEMETRY_SUMMARY_CMD:
+            set_drawbars_telemetry(TELEMETRY_SUMMARY, rpi_cmd_arg(DRAWBARS_TELEMETRY_WINDOW));
+            break;
+
+        case CC_INTERVAL_CMD: {
+            char* end;
+            long interval_ms = strtol(rpi_cmd.args(), &end, 10);
+            if (end != rpi_cmd.args() && *end == '\0')
+                set_cc_interval(interval_ms);
+            break;
         }
+
+        default:
+            send_user_requested_preset(rpi_cmd.code());
+            break;
     }
 }
 
 
-void send_user_requested_preset(String preset) {
+void send_user_requested_preset(uint16_t preset) {
+
+    // second character of the U0..U5 and L0..L5 commands
+    byte preset_nb = (preset >> 8) - '0';
+
+    switch (preset) {
+
+        case UPPER_A_CMD:
+            registration_leds.write(UP_REG_LED, HIGH);
+            reg_active[UPPER_A_GROUP] = true;
+            reg_active[UPPER_B_GROUP] = false;
+            send_group_positions(UPPER_A_GROUP);
+            break;
+
+        case UPPER_B_CMD:
+            registration_leds.write(UP_REG_LED, LOW);
+            reg_active[UPPER_A_GROUP] = false;
+            reg_active[UPPER_B_GROUP] = true;
+            send_group_positions(UPPER_B_GROUP);
+            break;
+
+        case LOWER_A_CMD:
+            registration_leds.write(LO_REG_LED, HIGH);
+            reg_active[LOWER_A_GROUP] = true;
+            reg_active[LOWER_B_GROUP] = false;
+            send_group_positions(LOWER_A_GROUP);
+            break;
+
+        case LOWER_B_CMD:
+            registration_leds.write(LO_REG_LED, LOW);
+            reg_active[LOWER_A_GROUP] = false;
+            reg_active[LOWER_B_GROUP] = true;
+            send_group_positions(LOWER_B_GROUP);
+            break;
+
+        // Upper [0..5] are the setBfree programs 7..12
+        case UPPER_0_CMD:
+        case UPPER_1_CMD:
+        case UPPER_2_CMD:
+        case UPPER_3_CMD:
+        case UPPER_4_CMD:
+        case UPPER_5_CMD:
+            reg_active[UPPER_A_GROUP] = false;
+            reg_active[UPPER_B_GROUP] = false;
+            send_program_change(0, 7 + preset_nb);
+            break;
+
+        // Lower [0..5] are the setBfree programs 1..6
+        case LOWER_0_CMD:
+        case LOWER_1_CMD:
+        case LOWER_2_CMD:
+        case LOWER_3_CMD:
+        case LOWER_4_CMD:
+        case LOWER_5_CMD:
+            reg_active[LOWER_A_GROUP] = false;
+            reg_active[LOWER_B_GROUP] = false;
+            send_program_change(0, 1 + preset_nb);
+            break;
+    }
+}
 
-    if (preset == rc.UPPER_A) {
 
-        digitalWrite(UP_REG_LED, HIGH);
-        reg_up_a = true;
-        reg_up_b = false;
-        send_drawbars_positions(preset);
-    }
+void select_drawbar(int mux) {
 
-    else if (preset == rc.UPPER_B) {
+    if (mux & 0x01) VPORTA.OUT |= MUX_A_bm; else VPORTA.OUT &= ~MUX_A_bm;
+    if (mux & 0x02) VPORTF.OUT |= MUX_B_bm; else VPORTF.OUT &= ~MUX_B_bm;
+    if (mux & 0x04) VPORTC.OUT |= MUX_C_bm; else VPORTC.OUT &= ~MUX_C_bm;
+}
 
-        digitalWrite(UP_REG_LED, LOW);
-        reg_up_a = false;
-        reg_up_b = true;
-        send_drawbars_positions(preset);
-    }
 
-    else if (preset == rc.LOWER_A) {
+void send_group_positions(byte group) {
 
-        digitalWrite(LO_REG_LED, HIGH);
-        reg_lo_a = true;
-        reg_lo_b = false;
-        send_drawbars_positions(preset);
+    for (int idx = 0; idx < NB_DRAWBARS; idx++) {
+        if (drawbars[idx].group == group)
+            queue_drawbar(idx);
     }
+}
 
-    else if (preset == rc.LOWER_B) {
-      
-        digitalWrite(LO_REG_LED, LOW);
-        reg_lo_a = false;
-        reg_lo_b = true;
-        send_drawbars_positions(preset);
-    }
 
-    else if (preset == rc.UPPER_0) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 7);
-    }
+void set_drawbars_mode(byte mode) {
 
-    else if (preset == rc.UPPER_1) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 8);
-    }
+    if (mode > CONTINUOUS_MODE)
+        return;
 
-    else if (preset == rc.UPPER_2) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 9);
-    }
+    drawbars_mode = mode;
 
-    else if (preset == rc.UPPER_3) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 10);
-    }
+    // pending values of the previous mode are replaced
+    for (int idx = 0; idx < NB_DRAWBARS; idx++)
+        queue_drawbar(idx);
+}
 
-    else if (preset == rc.UPPER_4) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 11);
-    }
 
-    else if (preset == rc.UPPER_5) {
-        
-        reg_up_a = false;
-        reg_up_b = false;
-        send_program_change(0, 12);
-    }
+void set_cc_interval(long interval_ms) {
 
-    else if (preset == rc.LOWER_0) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 1);
-    }
+    if (interval_ms >= 0 && interval_ms <= DRAWBAR_CC_INTERVAL_MAX_MS)
+        cc_interval_ms = interval_ms;
+}
 
-    else if (preset == rc.LOWER_1) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 2);
-    }
 
-    else if (preset == rc.LOWER_2) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 3);
-    }
+static uint16_t get_drawbar_value(int idx);
 
-    else if (preset == rc.LOWER_3) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 4);
-    }
 
-    else if (preset == rc.LOWER_4) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 5);
+void queue_drawbar(int idx) {
+
+    pending_value[idx] = drawbars_mode == STEPPED_MODE ? pos_new[idx] : get_drawbar_value(idx);
+}
+
+
+/*
+  Stores a new value of a moved drawbar into its pending slot.
+*/
+static void set_pending_value(int idx, uint16_t value) {
+
+    // the value it replaces will never be sent
+    if (pending_value[idx] != NO_VALUE)
+        cc_coalesced++;
+
+    pending_value[idx] = value;
+}
+
+// drawbar being converted by ADC0
+static byte scan_idx = 0;
+
+
+/*
+  Selects the drawbar scan_idx is pointing to: multiplexers address and ADC input.
+*/
+static void select_scanned_drawbar(void) {
+
+    const drawbarDef* dbar = &drawbars[scan_idx];
+
+    if (dbar->mux != NO_MUX)
+        select_drawbar(dbar->mux);
+
+    ADC0.MUXPOS = analogMuxPos[dbar->anlgIdx];
+}
+
+
+void start_drawbars_scanner(void) {
+
+    scan_idx = 0;
+
+    // reference and prescaler are left as set up by analogReference() and the core
+    ADC0.CTRLB = DRAWBAR_SAMPNUM;
+    ADC0.SAMPCTRL = DRAWBAR_SAMPLEN;
+    select_scanned_drawbar();
+
+    ADC0.INTFLAGS = ADC_RESRDY_bm;
+    ADC0.INTCTRL = ADC_RESRDY_bm;
+    ADC0.COMMAND = ADC_STCONV_bm;
+}
+
+
+ISR(ADC0_RESRDY_vect) {
+
+    // reading the result clears the interrupt flag
+    uint16_t measure = ADC0.RES;
+
+    if (calibrating) {
+        if (measure < cal_min[scan_idx])
+            cal_min[scan_idx] = measure;
+        if (measure > cal_max[scan_idx])
+            cal_max[scan_idx] = measure;
     }
 
-    else if (preset == rc.LOWER_5) {
-        
-        reg_lo_a = false;
-        reg_lo_b = false;
-        send_program_change(0, 6);
+    dbar_raw[scan_idx] = measure;
+    store_drawbar_position(measure, scan_idx);
+
+    // exponential average over 4 sweeps, the first sweep sets it
+    uint16_t filtered = dbar_filtered[scan_idx];
+    dbar_filtered[scan_idx] = filtered == 0 ? measure * 4 : filtered + measure - filtered / 4;
+
+    if (++scan_idx >= NB_DRAWBARS) {
+        scan_idx = 0;
+        sweeps++;
     }
+
+    select_scanned_drawbar();
+    ADC0.COMMAND = ADC_STCONV_bm;
 }
 
 
-void select_drawbar(int mux) {
+byte get_drawbars_sweeps(void) {
 
-    digitalWrite(MUX_A, mux & 0x01 ? HIGH : LOW);
-    digitalWrite(MUX_B, mux & 0x02 ? HIGH : LOW);
-    digitalWrite(MUX_C, mux & 0x04 ? HIGH : LOW);
+    return sweeps;
 }
 
 
-void send_drawbars_positions(String preset) {
+void send_moved_drawbars_settings(void) {
 
-    if (preset == rc.UPPER_A) {
-        for (int idx = 0; idx <= 8; idx++) {
-            on_drawbar_move(idx);
-        }
-    }
+    static byte last_sweeps = 0;
+
+    byte done = sweeps;
+
+    // drawbars are moved all the way during calibration: not to be heard
+    if (done == last_sweeps || calibrating)
+        return;
+
+    last_sweeps = done;
 
-    else if (preset == rc.UPPER_B) {
-        for (int idx = 9; idx <= 17; idx++) {
-            on_drawbar_move(idx);
+    if (drawbars_mode == STEPPED_MODE) {
+        for (int idx = 0; idx < NB_DRAWBARS; idx++) {
+
+            byte pos = pos_new[idx];
+            uint16_t last = pending_value[idx] != NO_VALUE ? pending_value[idx] : pos_old[idx];
+
+            if (pos != last)
+                set_pending_value(idx, pos);
         }
+        return;
     }
 
-    else if (preset == rc.BASS) {
-        for (int idx = 18; idx <= 19; idx++) {
-            on_drawbar_move(idx);
-        }
+    for (int idx = 0; idx < NB_DRAWBARS; idx++) {
+
+        uint16_t value = get_drawbar_value(idx);
+        uint16_t last = pending_value[idx] != NO_VALUE ? pending_value[idx] : last_value[idx];
+
+        bool moved = last == NO_VALUE
+            || (value > last ? value - last : last - value) > CONTINUOUS_DEADBAND
+            || ((value == 0 || value == 0x3FFF) && value != last);
+
+        if (moved)
+            set_pending_value(idx, value);
     }
-    
-    else if (preset == rc.LOWER_A) {
-        for (int idx = 20; idx <= 28; idx++) {
-            on_drawbar_move(idx);
-        }
+}
+
+
+void send_pending_drawbars(void) {
+
+    // drawbar looked at first: every pending drawbar gets its turn
+    static byte next_idx = 0;
+
+    // output budget in bytes, refilled every ms
+    static byte budget = DRAWBARS_OUTPUT_BURST_BYTES;
+    static uint16_t budget_ms = 0;
+
+    uint16_t now = millis();
+    uint16_t elapsed = now - budget_ms;
+
+    if (elapsed > 0) {
+        budget_ms = now;
+        if (elapsed > DRAWBARS_OUTPUT_BURST_BYTES)
+            elapsed = DRAWBARS_OUTPUT_BURST_BYTES;
+        budget = min(budget + elapsed * DRAWBARS_OUTPUT_BYTES_PER_MS, DRAWBARS_OUTPUT_BURST_BYTES);
     }
 
-    else if (preset == rc.LOWER_B) {
-        for (int idx = 29; idx <= 37; idx++) {
-            on_drawbar_move(idx);
+    // one CC message per drawbar
+    const byte cost = 3;
+
+    for (int n = 0; n < NB_DRAWBARS; n++) {
+
+        byte idx = next_idx;
+        uint16_t value = pending_value[idx];
+
+        if (value != NO_VALUE && (uint16_t)(now - last_sent_ms[idx]) >= cc_interval_ms) {
+
+            // inactive drawbars only update their state
+            if (is_drawbar_index_in_user_registration_range(idx)) {
+
+                // out of budget, or Serial.write() would wait: this drawbar goes first next time
+                if (budget < cost || Serial.availableForWrite() < cost)
+                    return;
+
+                budget -= cost;
+            }
+
+            pending_value[idx] = NO_VALUE;
+
+            if (drawbars_mode == STEPPED_MODE)
+                on_drawbar_move(idx, value);
+            else
+                on_drawbar_slide(idx, value);
         }
+
+        if (++next_idx >= NB_DRAWBARS)
+            next_idx = 0;
     }
 }
 
 
-void send_active_moved_drawbars_settings() {
+/*
+  Drawbar measure scaled to 14 bits between its calibrated end stops:
+  0 when pushed in, 0x3FFF when pulled out.
+*/
+static uint16_t get_drawbar_value(int idx) {
+
+    noInterrupts();
+    uint16_t measure = dbar_filtered[idx] / 4;
+    interrupts();
+
+    uint16_t lo = calibration.lo[idx] * DRAWBAR_CAL_SCALE;
+    uint16_t hi = calibration.hi[idx] * DRAWBAR_CAL_SCALE + DRAWBAR_CAL_SCALE - 1;
+
+    if (measure <= lo)
+        return 0;
+    if (measure >= hi)
+        return 0x3FFF;
+
+    return (unsigned long)(measure - lo) * 0x3FFF / (hi - lo);
+}
+
+
+void store_drawbar_position(int anlgMeasure, int idx) {
 
-    int idx = 0;  // drawbar index
-    int anlgMeasure = 0;
+    const uint16_t* breakpoints = dbar_breakpoints[idx];
 
-    //                       -- UPPER --    BASS    --- LOWER ---
-    // drawbars array index [0..8][9..17] [18..19] [20..28][29..37]
+    byte pos = 0;
+    while (pos < 8 && anlgMeasure >= (int)breakpoints[pos])
+        pos++;
 
-    // =================================  Board 1  ==================================
+    byte cur = pos_new[idx];
 
-    for (int mux = 0; mux <= 7; mux++) {
+    if (pos == cur)
+        return;
 
-        select_drawbar(mux);
-        delay(10);  // ms
-        anlgMeasure = analogRead(analogPins[0]);
-        store_drawbar_position(anlgMeasure, idx);
+    // the measure must be clearly inside the new window, on the side it comes from
+    if (cur != DRAWBAR_POS_INIT) {
 
-        if (pos_new[idx] != pos_old[idx])
-            on_drawbar_move(idx);
+        bool clear = pos > cur
+            ? anlgMeasure >= (int)breakpoints[pos - 1] + DRAWBAR_HYSTERESIS
+            : anlgMeasure < (int)breakpoints[pos] - DRAWBAR_HYSTERESIS;
 
-        idx++;
+        if (! clear) {
+            // a drawbar resting near a boundary is rejected on every sweep
+            if (pos != pos_rejected[idx]) {
+                pos_rejected[idx] = pos;
+                suppressed_changes++;
+            }
+            return;
+        }
     }
 
-    delay(10);  // ms
-    anlgMeasure = analogRead(analogPins[1]);
-    store_drawbar_position(anlgMeasure, idx);
+    pos_new[idx] = pos;
+    pos_rejected[idx] = DRAWBAR_POS_INIT;
+}
 
-    if (pos_new[idx] != pos_old[idx])
-        on_drawbar_move(idx);
 
-    idx++;
+static byte calibration_checksum(void) {
 
-    // =================================  Board 2  ==================================
+    byte sum = calibration.magic;
+    for (int i = 0; i < NB_DRAWBARS; i++)
+        sum += calibration.lo[i] + calibration.hi[i];
 
-    for (int mux = 0; mux <= 7; mux++) {
+    return ~sum;
+}
 
-        select_drawbar(mux);
-        delay(10);  //ms
-        anlgMeasure = analogRead(analogPins[2]);
-        store_drawbar_position(anlgMeasure, idx);
 
-        if (pos_new[idx] != pos_old[idx])
-            on_drawbar_move(idx);
+/*
+  Computes the position windows of a drawbar from its calibrated end stops.
+*/
+static void compute_breakpoints(int idx) {
 
-        idx++;
-    }
+    uint16_t lo = calibration.lo[idx] * DRAWBAR_CAL_SCALE;
+    uint16_t hi = calibration.hi[idx] * DRAWBAR_CAL_SCALE + DRAWBAR_CAL_SCALE - 1;
+    uint16_t breakpoints[8];
+
+    for (int pos = 1; pos <= 8; pos++)
+        breakpoints[pos - 1] = lo + (unsigned long)(hi - lo) * (2 * pos - 1) / 16;
 
-    for (int mux = 0; mux <= 2; mux++) {
+    // the ADC0 interrupt must not see a half updated drawbar
+    noInterrupts();
+    memcpy(dbar_breakpoints[idx], breakpoints, sizeof(breakpoints));
+    interrupts();
+}
 
-        select_drawbar(mux);
-        delay(10);  // ms
-        anlgMeasure = analogRead(analogPins[3]);
-        store_drawbar_position(anlgMeasure, idx);
 
-        if (pos_new[idx] != pos_old[idx])
-            on_drawbar_move(idx);
+static void default_calibration(void) {
 
-        idx++;
+    calibration.magic = DRAWBARS_CALIBRATION_MAGIC;
+
+    for (int i = 0; i < NB_DRAWBARS; i++) {
+        calibration.lo[i] = 0;
+        calibration.hi[i] = (1023 * DRAWBAR_OVERSAMPLING) / DRAWBAR_CAL_SCALE;
     }
+}
 
-    // =================================  Board 3  ==================================
-    
-    for (int mux = 0; mux <= 7; mux++) {
 
-        select_drawbar(mux);
-        delay(10);  // ms
-        anlgMeasure = analogRead(analogPins[4]);
-        store_drawbar_position(anlgMeasure, idx);
+void load_drawbars_calibration(void) {
+
+    eeprom_read_block(&calibration, (const void*)DRAWBARS_EEPROM_CALIBRATION, sizeof(calibration));
+
+    if (calibration.magic != DRAWBARS_CALIBRATION_MAGIC || calibration.checksum != calibration_checksum())
+        default_calibration();
+
+    for (int i = 0; i < NB_DRAWBARS; i++)
+        compute_breakpoints(i);
+}
+
 
-        if (pos_new[idx] != pos_old[idx])
-            on_drawbar_move(idx);
+void start_drawbars_calibration(void) {
 
-        idx++;
+    noInterrupts();
+    for (int i = 0; i < NB_DRAWBARS; i++) {
+        cal_min[i] = 0xFFFF;
+        cal_max[i] = 0;
     }
+    calibrating = true;
+    interrupts();
 
-    delay(10);  // ms
-    anlgMeasure = analogRead(analogPins[5]);
-    store_drawbar_position(anlgMeasure, idx);
+    digitalWrite(DEBUG_LED, HIGH);
+    registration_leds.pulse(B3_LEDS_ALL, CALIBRATION_LEDS_PERIOD_MS, 0);
+}
 
-    if (pos_new[idx] != pos_old[idx])
-        on_drawbar_move(idx);
 
-    idx++;
+void end_drawbars_calibration(void) {
 
-    // =================================  Board 4  ==================================
+    if (! calibrating)
+        return;
 
-    for (int mux = 0; mux <= 7; mux++) {
+    calibrating = false;
+    digitalWrite(DEBUG_LED, LOW);
 
-        select_drawbar(mux);
-        delay(10);  // ms
-        anlgMeasure = analogRead(analogPins[6]);
-        store_drawbar_position(anlgMeasure, idx);
+    for (int i = 0; i < NB_DRAWBARS; i++) {
 
-        if (pos_new[idx] != pos_old[idx])
-            on_drawbar_move(idx);
+        if (cal_max[i] < cal_min[i] || cal_max[i] - cal_min[i] < DRAWBAR_CAL_MIN_SPAN)
+            continue;  // not moved: previous calibration kept
 
-        idx++;
+        calibration.lo[i] = cal_min[i] / DRAWBAR_CAL_SCALE;
+        calibration.hi[i] = cal_max[i] / DRAWBAR_CAL_SCALE;
+        compute_breakpoints(i);
     }
 
-    delay(10);  // ms
-    anlgMeasure = analogRead(analogPins[7]);
-    store_drawbar_position(anlgMeasure, idx);
+    calibration.checksum = calibration_checksum();
+    eeprom_update_block(&calibration, (void*)DRAWBARS_EEPROM_CALIBRATION, sizeof(calibration));
 
-    if (pos_new[idx] != pos_old[idx])
-        on_drawbar_move(idx);
+    registration_leds.confirm(B3_LEDS_ALL);
 }
 
 
-void store_drawbar_position(int anlgMeasure, int idx) {
+void clear_drawbars_calibration(void) {
 
-    if (anlgMeasure >= 0 && anlgMeasure <= 63)
-        pos_new[idx] = 0;
+    calibrating = false;
+    digitalWrite(DEBUG_LED, LOW);
+
+    default_calibration();
 
-    else if (anlgMeasure >= 64 && anlgMeasure <= 191)
-        pos_new[idx] = 1;
+    for (int i = 0; i < NB_DRAWBARS; i++)
+        compute_breakpoints(i);
 
-    else if (anlgMeasure >= 192 && anlgMeasure <= 319)
-        pos_new[idx] = 2;
+    // an invalid record: defaults are loaded on next power up
+    calibration.checksum = ~calibration_checksum();
+    eeprom_update_block(&calibration, (void*)DRAWBARS_EEPROM_CALIBRATION, sizeof(calibration));
 
-    else if (anlgMeasure >= 320 && anlgMeasure <= 447)
-        pos_new[idx] = 3;
+    registration_leds.confirm(B3_LEDS_ALL);
+}
 
-    else if (anlgMeasure >= 448 && anlgMeasure <= 575)
-        pos_new[idx] = 4;
 
-    else if (anlgMeasure >= 576 && anlgMeasure <= 703)
-        pos_new[idx] = 5;
+void on_drawbar_move(int idx, byte pos) {
 
-    else if (anlgMeasure >= 704 && anlgMeasure <= 831)
-        pos_new[idx] = 6;
+    if (is_drawbar_index_in_user_registration_range(idx)) {
 
-    else if (anlgMeasure >= 832 && anlgMeasure <= 959)
-        pos_new[idx] = 7;
+        byte midiChnl = get_midi_channel(idx);
+        int midiCtrl = get_midi_controller(idx);
+        send_control_change(midiChnl, midiCtrl, dbar_pos[pos]);
+    }
 
-    else if (anlgMeasure >= 960 && anlgMeasure <= 1023)
-        pos_new[idx] = 8;
+    pos_old[idx] = pos;
+    last_sent_ms[idx] = millis();
 }
 
 
-void on_drawbar_move(int idx) {
+void on_drawbar_slide(int idx, uint16_t value) {
 
     if (is_drawbar_index_in_user_registration_range(idx)) {
 
+        // setBfree drawbars: 0 is the loudest (pulled out) position
+        uint16_t cc = 0x3FFF - value;
+
         byte midiChnl = get_midi_channel(idx);
         int midiCtrl = get_midi_controller(idx);
-        send_control_change(midiChnl, midiCtrl, dbar_pos[pos_new[idx]]);
+        send_control_change(midiChnl, midiCtrl, cc >> 7);
     }
 
-    pos_old[idx] = pos_new[idx];
+    last_value[idx] = value;
+    last_sent_ms[idx] = millis();
 }
 
 
 bool is_drawbar_index_in_user_registration_range(int idx) {
 
-    return  (idx >= 0 && idx <= 8 && reg_up_a) ||
-            (idx >= 9 && idx <= 17 && reg_up_b) ||
-            (idx == 18 || idx == 19) ||
-            (idx >= 20 && idx <= 28 && reg_lo_a) ||
-            (idx >= 29 && idx <= 37 && reg_lo_b);
+    return reg_active[drawbars[idx].group];
 }
 
 
 byte get_midi_channel(int idx) {
 
-    if (idx >= 0 && idx <= 8)
-        return mc.UPPER_A;
-
-    else if (idx >= 9 && idx <= 17)
-        return mc.UPPER_B;
+    return drawbars[idx].channel;
+}
 
-    else if (idx == 18 || idx == 19)
-        return mc.BASS;
 
-    else if (idx >= 20 && idx <= 28)
-        return mc.LOWER_A;
+int get_midi_controller(int idx) {
 
-    else
-        return mc.LOWER_B;
+    return drawbars[idx].controller;
 }
 
 
-int get_midi_controller(int idx) {
+/*
+  Shadow entry of a channel and controller, NULL if not a drawbar one.
+*/
+static byte* cc_shadow_entry(byte channel, byte controller) {
 
-    if (idx >= 0 && idx <= 17)
-        return 70 + (idx % 9);
+    if (channel >= SHADOW_NB_CHANNELS)
+        return NULL;
 
-    else if (idx == 18)
-        return 70;
+    byte ctrl = controller - SHADOW_FIRST_CONTROLLER;
+    if (ctrl >= SHADOW_NB_CONTROLLERS)
+        return NULL;
+
+    return &cc_shadow[channel][ctrl];
+}
 
-    else if (idx == 19)
-        return 72;
 
-    else
-        return 70 + ((idx - 20) % 9);
+void clear_control_change_shadow(void) {
+
+    memset(cc_shadow, SHADOW_UNKNOWN, sizeof(cc_shadow));
 }
 
 
 void send_control_change(byte channel, byte controller, byte value) {
+
+    byte* shadow = cc_shadow_entry(channel, controller);
+    if (shadow != NULL) {
+        if (*shadow == value) {
+            cc_skipped++;
+            return;
+        }
+        *shadow = value;
+    }
+
     byte bytes[3];
     bytes[0] = 0xB0 | channel;
     bytes[1] = controller;
     bytes[2] = value;
     Serial.write(bytes, 3);
+    cc_sent++;
     
     // Keep these lines commented out for non audible drawbars moves.
     // digitalWrite(DEBUG_LED, HIGH);
@@ -592,12 +953,188 @@ void send_control_change(byte channel, byte controller, byte value) {
 }
 
 
+
+void send_drawbars_stats(void) {
+
+    noInterrupts();
+    unsigned long suppressed = suppressed_changes;
+    interrupts();
+
+    byte bytes[17];
+    bytes[0] = SYSEX_START;
+    bytes[1] = SYSEX_NON_COMMERCIAL_ID;
+    bytes[2] = DRAWBARS_SYSEX_DEVICE_ID;
+    bytes[3] = DRAWBARS_SYSEX_STATS;
+    byte* data = putSysExCount(putSysExCount(&bytes[4], cc_sent), suppressed);
+    putSysExCount(putSysExCount(data, cc_skipped), cc_coalesced);
+    bytes[16] = SYSEX_END;
+    Serial.write(bytes, sizeof(bytes));
+}
+
+
+void set_drawbars_telemetry(byte mode, long sweeps) {
+
+    if (mode == TELEMETRY_RAW && (sweeps < 1 || sweeps > DRAWBARS_TELEMETRY_DECIMATION_MAX))
+        return;
+
+    if (mode == TELEMETRY_SUMMARY && (sweeps < 2 || sweeps > DRAWBARS_TELEMETRY_WINDOW_MAX))
+        return;
+
+    if (mode > TELEMETRY_SUMMARY)
+        return;
+
+    telemetry_mode = mode;
+    telemetry_sweeps = sweeps;
+    telemetry_count = 0;
+    telemetry_next = NB_DRAWBARS;
+}
+
+
+static byte* put_measure(byte* data, uint16_t measure) {
+
+    *data++ = measure & 0x7F;
+    *data++ = (measure >> 7) & 0x7F;
+
+    return data;
+}
+
+
+/*
+  Sends the messages of the current raw frame or summary window, as long as
+  the Serial transmit buffer has room for a whole message.
+*/
+static void send_telemetry_messages(void) {
+
+    while (telemetry_next < NB_DRAWBARS) {
+
+        byte bytes[7 + 2 * DRAWBARS_TELEMETRY_PER_MSG];
+        byte* data = &bytes[4];
+        byte first = telemetry_next;
+
+        bytes[0] = SYSEX_START;
+        bytes[1] = SYSEX_NON_COMMERCIAL_ID;
+        bytes[2] = DRAWBARS_SYSEX_DEVICE_ID;
+
+        if (telemetry_mode == TELEMETRY_RAW) {
+
+            byte last = min(first + DRAWBARS_TELEMETRY_PER_MSG, NB_DRAWBARS);
+
+            bytes[3] = DRAWBARS_SYSEX_RAW;
+            *data++ = telemetry_seq;
+            *data++ = first;
+            for (byte idx = first; idx < last; idx++)
+                data = put_measure(data, telemetry.frame[idx]);
+
+            telemetry_next = last;
+        }
+        else {
+
+            uint32_t nb = telemetry_count;
+            uint32_t sum = telemetry.window.sum[first];
+            uint32_t mean = (sum + nb / 2) / nb;
+            uint32_t variance = (telemetry.window.sum_sq[first] - (uint64_t)sum * sum / nb) / nb;
+
+            bytes[3] = DRAWBARS_SYSEX_SUMMARY;
+            *data++ = first;
+            *data++ = nb;
+            data = put_measure(data, mean);
+            data = putSysExCount(data, variance);
+            data = put_measure(data, telemetry.window.min[first]);
+            data = put_measure(data, telemetry.window.max[first]);
+
+            telemetry_next = first + 1;
+        }
+
+        *data++ = SYSEX_END;
+
+        int len = data - bytes;
+        if (Serial.availableForWrite() < len) {
+            telemetry_next = first;  // built again next time
+            return;
+        }
+
+        Serial.write(bytes, len);
+    }
+
+    // the next window starts once the summary is sent
+    if (telemetry_mode == TELEMETRY_SUMMARY)
+        telemetry_count = 0;
+}
+
+
+void send_drawbars_telemetry(void) {
+
+    static byte last_sweeps = 0;
+
+    if (telemetry_mode == TELEMETRY_OFF)
+        return;
+
+    if (telemetry_next < NB_DRAWBARS) {
+        send_telemetry_messages();
+        return;
+    }
+
+    byte done = sweeps;
+
+    if (done == last_sweeps)
+        return;
+
+    last_sweeps = done;
+
+    uint16_t raw[NB_DRAWBARS];
+    noInterrupts();
+    for (int idx = 0; idx < NB_DRAWBARS; idx++)
+        raw[idx] = dbar_raw[idx];
+    interrupts();
+
+    if (telemetry_mode == TELEMETRY_RAW) {
+
+        if (++telemetry_count < telemetry_sweeps)
+            return;
+
+        telemetry_count = 0;
+        memcpy(telemetry.frame, raw, sizeof(raw));
+        telemetry_seq = done & 0x7F;
+    }
+    else {
+
+        for (int idx = 0; idx < NB_DRAWBARS; idx++) {
+
+            uint16_t measure = raw[idx];
+
+            if (telemetry_count == 0) {
+                telemetry.window.sum[idx] = 0;
+                telemetry.window.sum_sq[idx] = 0;
+                telemetry.window.min[idx] = measure;
+                telemetry.window.max[idx] = measure;
+            }
+
+            telemetry.window.sum[idx] += measure;
+            telemetry.window.sum_sq[idx] += (uint32_t)measure * measure;
+            if (measure < telemetry.window.min[idx])
+                telemetry.window.min[idx] = measure;
+            if (measure > telemetry.window.max[idx])
+                telemetry.window.max[idx] = measure;
+        }
+
+        if (++telemetry_count < telemetry_sweeps)
+            return;
+    }
+
+    telemetry_next = 0;
+    send_telemetry_messages();
+}
+
+
 void send_program_change(byte channel, byte program) {
     byte bytes[2];
     bytes[0] = 0xC0 | channel;
     bytes[1] = program;
     Serial.write(bytes, 2);
 
+    // the preset has changed the drawbars of setBfree
+    clear_control_change_shadow();
+
     // Keep these lines commented out for non audible drawbars moves.
     // digitalWrite(DEBUG_LED, HIGH);
     // delay(DELAY_100_MS * 2);
@@ -611,12 +1148,7 @@ void send_program_change(byte channel, byte program) {
 
 void toggle_registration_leds(int toggles)
 {
-    for (int t=0; t<toggles; t++) {
-        digitalWrite(UP_REG_LED, HIGH);
-        digitalWrite(LO_REG_LED, HIGH);
-        delay(DELAY_100_MS * 2);
-        digitalWrite(UP_REG_LED, LOW);
-        digitalWrite(LO_REG_LED, LOW);
-        delay(DELAY_100_MS * 2);
-    }
+    if (toggles > 0)
+        registration_leds.blink(B3_LEDS_ALL, REGISTRATION_LEDS_PERIOD_MS, min(toggles, 0xFF));
 }
+
@@ -0,0 +1,94 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "b3_drawbars.h"
+
+extern unsigned long cc_sent;
+extern volatile unsigned long suppressed_changes;
+extern volatile byte pos_new[NB_DRAWBARS];
+extern uint16_t dbar_breakpoints[NB_DRAWBARS][8];
+
+
+/*
+* Executed before every test.
+*/
+void setUp(void) {
+    setup_ctrl_pins();
+    clear_control_change_shadow();
+}
+
+/*
+* Executed after every test.
+*/
+void tearDown(void) {
+    set_drawbars_mode(STEPPED_MODE);
+}
+
+// ===========================================================================
+//                        Control Change shadow tests
+// ===========================================================================
+
+void test_cc_shadow_skips_unchanged_value() {
+    set_drawbars_mode(CONTINUOUS_MODE);
+    unsigned long sent = cc_sent;
+
+    // drawbar 0 (upper A, active)
+    on_drawbar_slide(0, 0x1234);
+    TEST_ASSERT_EQUAL(sent + 1, cc_sent);
+
+    // 0x1200 gives the same 7-bit value as 0x1234: skipped
+    on_drawbar_slide(0, 0x1200);
+    TEST_ASSERT_EQUAL(sent + 1, cc_sent);
+
+    on_drawbar_slide(0, 0x11B4);
+    TEST_ASSERT_EQUAL(sent + 2, cc_sent);
+}
+
+
+// ===========================================================================
+//                        Position hysteresis tests
+// ===========================================================================
+
+void test_resting_drawbar_suppressed_once() {
+    load_drawbars_calibration();
+    pos_new[0] = 0;
+    unsigned long suppressed = suppressed_changes;
+
+    // drawbar 0 resting on the position 0/1 boundary, one measure per sweep
+    int boundary = dbar_breakpoints[0][0];
+    for (int sweep = 0; sweep < 10; sweep++)
+        store_drawbar_position(boundary, 0);
+
+    TEST_ASSERT_EQUAL(0, pos_new[0]);
+    TEST_ASSERT_EQUAL(suppressed + 1, suppressed_changes);
+
+    store_drawbar_position(boundary + DRAWBAR_HYSTERESIS, 0);
+    TEST_ASSERT_EQUAL(1, pos_new[0]);
+    TEST_ASSERT_EQUAL(suppressed + 1, suppressed_changes);
+}
+
+
+int run_unity_tests(void) {
+
+    UNITY_BEGIN();
+
+    RUN_TEST(test_cc_shadow_skips_unchanged_value);
+    RUN_TEST(test_resting_drawbar_suppressed_once);
+
+    return UNITY_END();
+}
+
+
+/*
+* For Arduino framework
+*/
+void setup() {
+  // Wait ~2 seconds before the Unity test runner
+  // establishes connection with a board Serial interface
+  delay(2000);
+
+  run_unity_tests();
+}
+
+void loop() {
+    // This is intentionally left empty
+}
@@ -6,6 +6,8 @@
 #define B3_KEYBOARDS_H
 
 #include <Arduino.h>
+#include <B3Midi.h>
+#include "b3_note_queue.h"
 
 // MIDI channels
 #define UPPER 0
@@ -18,10 +20,6 @@
 #define CLOSED true
 #define OPEN false
 
-// MIDI messages for On/Off
-#define NOTE_ON 0x90
-#define NOTE_OFF 0x80
-
 #define BRA 1  // D1
 #define BRB 2  // D2
 #define MKA 3  // D3
@@ -48,9 +46,124 @@
 // maximum number of supported keys
 #define KEYBOARDS_NB_PINS (MATRIX_NB_ROWS * MATRIX_NB_COLS)
 
-// MIDI keyboards keys velocity
-#define VELOCITY_MIN 0
-#define VELOCITY_MAX 0x7F
+// Note On velocity used when the keys state is resynchronized: the actual
+// velocity is long gone by then
+#define VELOCITY_RESYNC 0x40
+
+
+// ---------------------------- matrix I/O backend -----------------------------
+//
+// KBD_DIRECT_PORT_IO = 1 : T[7:0], MUX_A[3:1] and BRA/BRB/MKA/MKB are accessed
+//                          through the ATmega4809 virtual ports (VPORTx).
+// KBD_DIRECT_PORT_IO = 0 : Arduino digitalWrite()/digitalRead() calls.
+//
+// Can be forced from platformio.ini: build_flags = -D KBD_DIRECT_PORT_IO=0
+#ifndef KBD_DIRECT_PORT_IO
+#ifdef __AVR_ATmega4809__
+#define KBD_DIRECT_PORT_IO 1
+#else
+#define KBD_DIRECT_PORT_IO 0
+#endif
+#endif
+
+#if KBD_DIRECT_PORT_IO && !defined(__AVR_ATmega4809__)
+#error "KBD_DIRECT_PORT_IO requires an ATmega4809 (Arduino Nano Every)"
+#endif
+
+#ifdef __AVR_ATmega4809__
+// Arduino Nano Every pins to ATmega4809 ports mapping:
+//
+//  T0 = PD3   T1 = PD2   T2 = PD1   T3 = PD0
+//  T4 = PF2   T5 = PF3   T6 = PD4   T7 = PD5
+//
+//  BRA = PC4  MKB = PC6  BRB = PA0  MKA = PF5
+//
+//  MUX_A1 = PB2   MUX_A2 = PF4   MUX_A3 = PA1
+#define BRA_bm PIN4_bm  // VPORTC
+#define MKB_bm PIN6_bm  // VPORTC
+#define BRB_bm PIN0_bm  // VPORTA
+#define MKA_bm PIN5_bm  // VPORTF
+
+#define MUX_A1_bm PIN2_bm  // VPORTB
+#define MUX_A2_bm PIN4_bm  // VPORTF
+#define MUX_A3_bm PIN1_bm  // VPORTA
+#endif
+
+// time given to the column lines and to the multiplexers outputs to settle
+// before the switches are sampled (direct port backend only; digitalWrite()
+// is slow enough by itself)
+#define KBD_COLUMN_SETTLE_US 1.0
+#define KBD_MUX_SETTLE_US 0.5
+
+// one column is scanned by the TCB0 interrupt every KBD_COLUMN_PERIOD_US;
+// a full matrix scan takes MATRIX_NB_COLS periods. The period must stay above
+// the time taken by one column scan (select + read + changes processing): a
+// column whose 32 contacts all change takes up to ~2500 cycles (156 us), which
+// delays the next column instead of losing it, but a few changing contacts
+// must fit. The scan time is measured by the KBD_LATENCY_STATS report.
+// The full scan period is the resolution of the velocity measurement:
+// 512 us with the direct port backend, 800 us with digitalWrite/digitalRead.
+#ifndef KBD_COLUMN_PERIOD_US
+#if KBD_DIRECT_PORT_IO
+#define KBD_COLUMN_PERIOD_US 64
+#else
+#define KBD_COLUMN_PERIOD_US 100
+#endif
+#endif
+
+// shortest column period: 1024 cycles at 16 MHz
+#define KBD_COLUMN_PERIOD_MIN_US 64
+
+#if KBD_COLUMN_PERIOD_US < KBD_COLUMN_PERIOD_MIN_US
+#error "KBD_COLUMN_PERIOD_US is shorter than a column scan with a few changing contacts"
+#endif
+
+// Adaptive scan rate: once all the contacts have stayed open for
+// KBD_IDLE_TIMEOUT_MS, the column period goes up to KBD_IDLE_COLUMN_PERIOD_US;
+// it is back to KBD_COLUMN_PERIOD_US as soon as a scanned column has a closed
+// contact. The first contact of a key touched while idle is timestamped at the
+// idle rate: KBD_IDLE_COLUMN_PERIOD_US is kept short enough for that to be
+// lost within the break to make delay of a fast key stroke (2 ms full scan).
+// The idle timeout can be changed by the Raspberry PI; 0 disables the idle rate.
+#ifndef KBD_IDLE_COLUMN_PERIOD_US
+#define KBD_IDLE_COLUMN_PERIOD_US 250
+#endif
+
+#ifndef KBD_IDLE_TIMEOUT_MS
+#define KBD_IDLE_TIMEOUT_MS 2000
+#endif
+
+// TCB0 counts CLK_PER cycles on 16 bits
+#if KBD_IDLE_COLUMN_PERIOD_US > 4000 || KBD_COLUMN_PERIOD_US > KBD_IDLE_COLUMN_PERIOD_US
+#error "column periods must be KBD_COLUMN_PERIOD_US <= KBD_IDLE_COLUMN_PERIOD_US <= 4000 us"
+#endif
+
+// KBD_NOTE_OFF_AS_NOTE_ON = 1 : Note Off messages are sent as Note On with a 0
+//                               velocity, so a mix of Note On/Off on the same
+//                               channel shares one running status. The release
+//                               velocity is lost.
+// KBD_NOTE_OFF_AS_NOTE_ON = 0 : Note Off messages keep their release velocity;
+//                               only those with a VELOCITY_MIN one, which carry
+//                               no information, are sent as Note On.
+#ifndef KBD_NOTE_OFF_AS_NOTE_ON
+#define KBD_NOTE_OFF_AS_NOTE_ON 1
+#endif
+
+// KBD_RELEASE_VELOCITY = 1 : Note Off is sent when the break contact opens, with a
+//                            release velocity measured from the make contact opening.
+// KBD_RELEASE_VELOCITY = 0 : Note Off is sent when the make contact opens, with a
+//                            VELOCITY_MIN release velocity.
+// Measuring it only makes sense when it is sent, hence the default.
+#ifndef KBD_RELEASE_VELOCITY
+#define KBD_RELEASE_VELOCITY (!KBD_NOTE_OFF_AS_NOTE_ON)
+#endif
+
+#if KBD_RELEASE_VELOCITY && KBD_NOTE_OFF_AS_NOTE_ON
+#warning "KBD_RELEASE_VELOCITY delays Note Off to the break contact but KBD_NOTE_OFF_AS_NOTE_ON drops its velocity"
+#endif
+
+// number of full matrix scans timed by the KBD_SCAN_BENCHMARK report
+#define KBD_BENCHMARK_SCANS 1000
 
 
 /*
@@ -64,6 +177,40 @@ void setup_keyboards_ctrl_pins(void);
 */
 void init_keyboards(void);
 
+
+/*
+  Configures TCB0 as a periodic interrupt source firing every KBD_COLUMN_PERIOD_US.
+  The interrupt calls scan_next_column().
+  On builds without an ATmega4809 this does nothing: the caller is expected to
+  call scan_next_column() at the column period by itself.
+*/
+void setup_scan_timer(void);
+
+
+/*
+  Scans the next Fatar keyboards column: selects it, reads all its switches and
+  queues the resulting note events. Switches between the fast and the idle
+  column periods. Runs in interrupt context.
+*/
+void scan_next_column(void);
+
+
+/*
+  Current column period in us: KBD_COLUMN_PERIOD_US or KBD_IDLE_COLUMN_PERIOD_US.
+*/
+unsigned int get_column_period_us(void);
+
+
+/*
+  Sets the time all the contacts must stay open before the scan goes to the
+  idle rate.
+
+  @param timeout_ms : [0..16383] ms; 0 keeps the fast rate forever
+*/
+void set_idle_timeout(unsigned int timeout_ms);
+unsigned int get_idle_timeout(void);
+
+
 /*
   Activates one of the T[7:0] Fatar keyboard columns.
 
@@ -83,6 +230,64 @@ void select_keyboard_column(unsigned int column);
 void read_all_switches(byte* switches);
 
 
+/*
+  digitalWrite() / digitalRead() based implementations of select_keyboard_column()
+  and read_all_switches(). Always built: they are the reference the direct port
+  backend is checked and benchmarked against.
+*/
+void select_keyboard_column_digital(unsigned int column);
+void read_all_switches_digital(byte* switches);
+
+
+#ifdef __AVR_ATmega4809__
+/*
+  VPORT based implementations of select_keyboard_column() and read_all_switches().
+
+  The column select is one store per port (T[7:0] are spread over PORTD and
+  PORTA). The multiplexer address is walked in Gray code order (0 1 3 2 6 7 5 4)
+  so each step flips a single MUX_A line with one sbi/cbi instruction, and the
+  four switch lines are sampled with one IN read per port (C, A, F).
+*/
+void select_keyboard_column_vport(unsigned int column);
+void read_all_switches_vport(byte* switches);
+#endif
+
+
+#ifdef KBD_LATENCY_STATS
+/*
+  Latency diagnostics, built with the nano_every_local_keyboards_latency
+  environment. Three statistics are kept (see b3_latency.h):
+    - note latency, from the scan which saw the contact to the Serial.write()
+      of the note,
+    - scan jitter, distance between the actual interval of two column scans
+      and the column period,
+    - column scan time, from the compare match to the end of the scan
+      interrupt (on the board only).
+  report_latency_stats() sends them as KBD_CMD_LATENCY_REPORT SysEx messages
+  (see b3_rpi_cmd.h) in the normal output stream; reset_latency_stats() clears
+  them.
+*/
+void report_latency_stats(void);
+void reset_latency_stats(void);
+#endif
+
+
+#ifdef KBD_SCAN_BENCHMARK
+/*
+  Times KBD_BENCHMARK_SCANS full matrix scans (8 columns select + read) with
+  each available backend and prints the CPU cycles per full scan on Serial.
+  Build with the nano_every_local_keyboards_bench environment; the report is
+  plain text and must not be sent to setBfree.
+*/
+void report_scan_benchmark(void);
+#endif
+
+
+// even bits of a column switches word are make contacts, odd bits break contacts
+#define MAKE_CONTACTS 0x55555555UL
+#define BREAK_CONTACTS 0xAAAAAAAAUL
+
+
 /*
   Looks for keyboards notes changes.
 
@@ -92,33 +297,60 @@ void read_all_switches(byte* switches);
   bra7 mka7 ... bra4 mka4   bra3 mka3 ... bra0 mka0       brb7 mkb7 ... brb4 mkb4   brb3 mkb3 ... brb0 mkb0
 
   col    :  the selected Fatar keyboards column
+
+  Rows (bits) are the keyboards break and make switches:
+                  lower kb make contacts are at row  0, 2, 4, 6, 8, 10, 12, 14
+                  lower kb break contacts are at row 1, 3, 5, 7, 9, 11, 13, 15
+                  upper kb make contacts are at row  16, 18, 20, 22, 24, 26, 28, 30
+                  upper kb break contacts are at row 17, 19, 21, 23, 25, 27, 29, 31
+
+  The break/make debouncing state machine runs on whole 32-bit words for all
+  the keys of the column at once; only the keys which fire a note or need a
+  timestamp are then visited, with count-trailing-zeros iteration.
+
+  The break contact closing time is stored per key; the Note On velocity is
+  derived from the delay until the make contact closes. When KBD_RELEASE_VELOCITY
+  is set, the release velocity is derived the same way from the make contact
+  opening to the break contact opening.
 */
 void look_for_changes(byte* values, byte col);
 
 
 /*
-  Called whenever a switch state has changed.
+  Turns a key event taken from the note queue into MIDI notes through the key
+  map (see b3_keymap.h): none for a muted key, two for a layered one.
+  Called from loop().
+*/
+void play_key(const note_event* ev);
 
-  @param row    : keyboards break and make switches index (0 to 31)
-                  lower kb make contacts are at row  0, 2, 4, 6, 8, 10, 12, 14
-                  lower kb break contacts are at row 1, 3, 5, 7, 9, 11, 13, 15
-                  upper kb make contacts are at row  16, 18, 20, 22, 24, 26, 28, 30
-                  upper kb break contacts are at row 17, 19, 21, 23, 25, 27, 29, 31
 
-  @param col    : column index (Fatar keyboards T bus index, 0 to 7)
+/*
+  Sends the keys currently down as a KBD_CMD_KEY_STATE_DUMP SysEx message
+  (see b3_rpi_cmd.h). The state is the one sent to the Raspberry PI so far:
+  notes still in the queue are not included, they follow the dump.
+*/
+void dump_key_state(void);
+
 
-  @param closed : true if switch depressed, false if released
+/*
+  Compares the keys the Raspberry PI believes are down with the actual ones
+  and sends only the differences: Note On (VELOCITY_RESYNC) for the keys it
+  missed, Note Off for the ones it holds wrongly.
+
+  @param packed : KEY_STATE_SYSEX_LEN bytes, same layout as the dump
 */
-void notify_toggle(byte row, byte col, bool closed);
+void sync_key_state(const byte* packed);
+
 
 /*
-   Plays a MIDI note.
+   Appends a MIDI note to the serial link output buffer.
 
-   @param chnl    : MIDI channel the note is sent to
-   @param pitch   : note value
-   @param on      : note ON if true; OFF otherwise
+   @param chnl     : MIDI channel the note is sent to
+   @param pitch    : note value
+   @param on       : note ON if true; OFF otherwise
+   @param velocity : Note On velocity [1..127] or Note Off release velocity
 */
-void send_note(byte chnl, byte pitch, bool on);
+void send_note(byte chnl, byte pitch, bool on, byte velocity);
 
 
 #endif // B3_KEYBOARDS_H
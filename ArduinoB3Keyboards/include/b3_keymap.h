@@ -0,0 +1,52 @@
+// ===========================================================================
+// b3_keymap.h
+// keys to MIDI channel / pitch mapping
+// ===========================================================================
+#ifndef B3_KEYMAP_H
+#define B3_KEYMAP_H
+
+#include <Arduino.h>
+#include "b3_keyboards.h"
+
+// one entry per key (make/break contacts pair): 0..63 lower kb, 64..127 upper kb
+#define KEY_MAP_SIZE (KEYBOARDS_NB_PINS / 2)
+
+// key_map_entry flags; all fields are 7-bit values so that entries can be
+// carried as is in SysEx messages
+#define KEY_MUTED 0x40       // the key sends nothing
+#define KEY_LAYERED 0x20     // the note is also sent on the KEY_LAYER_CHNL channel
+#define KEY_LAYER_CHNL 0x0F
+
+struct key_map_entry {
+    byte chnl;   // MIDI channel [0..15]
+    byte pitch;  // MIDI note [0..127]
+    byte flags;  // KEY_MUTED, KEY_LAYERED | layer channel
+};
+
+
+/*
+  Loads the default layout: lower kb on channel LOWER, upper kb on channel UPPER,
+  both starting at C1 (36), keys above C6 (96) clamped to C6.
+  The default table is built at compile time and stored in flash.
+*/
+void key_map_init(void);
+
+
+/*
+  Replaces a key entry. Entries are only read from loop(), so a new layout can
+  be loaded at any time (see play_key() for notes held during the change).
+
+  @param key   : key index [0..KEY_MAP_SIZE - 1]; ignored if out of range
+  @param entry : new mapping
+*/
+void key_map_set(byte key, const key_map_entry* entry);
+
+
+/*
+  Returns the mapping of a key.
+
+  @param key : key index [0..KEY_MAP_SIZE - 1]
+*/
+const key_map_entry* key_map_get(byte key);
+
+#endif // B3_KEYMAP_H
@@ -0,0 +1,66 @@
+// ===========================================================================
+// b3_latency.h
+// note latency and scan jitter statistics (KBD_LATENCY_STATS builds)
+// ===========================================================================
+#ifndef B3_LATENCY_H
+#define B3_LATENCY_H
+
+#include <Arduino.h>
+
+// Histogram buckets are powers of two: bucket 0 counts the values below
+// 2^shift us, bucket i the values in [2^(shift+i-1), 2^(shift+i)) us, the last
+// one everything above.
+#define LATENCY_NB_BUCKETS 8
+
+// note latency: scan timestamp to Serial.write(), buckets from 64 us to 4 ms
+#define NOTE_LATENCY_BUCKET_SHIFT 6
+
+// scan jitter: distance between the actual and the expected column period,
+// buckets from 1 us to 64 us
+#define SCAN_JITTER_BUCKET_SHIFT 0
+
+// column scan time: compare match to the end of the scan interrupt, buckets
+// from 4 us to 256 us
+#define COLUMN_SCAN_BUCKET_SHIFT 2
+
+// SysEx data length of one latency_stats (see latency_to_sysex())
+#define LATENCY_SYSEX_LEN (3 * (4 + LATENCY_NB_BUCKETS))
+
+struct latency_stats {
+    unsigned long count;
+    unsigned long sum;
+    uint16_t min;
+    uint16_t max;
+    uint16_t buckets[LATENCY_NB_BUCKETS];  // saturate at 0xFFFF
+    byte bucket_shift;
+};
+
+
+/*
+  Clears the statistics.
+
+  @param stats        : statistics to be cleared
+  @param bucket_shift : NOTE_LATENCY_BUCKET_SHIFT, SCAN_JITTER_BUCKET_SHIFT or
+                        COLUMN_SCAN_BUCKET_SHIFT
+*/
+void latency_reset(latency_stats* stats, byte bucket_shift);
+
+
+/*
+  Accounts one measure.
+
+  @param us : measured time in us
+*/
+void latency_record(latency_stats* stats, uint16_t us);
+
+
+/*
+  Writes the statistics as the data of a SysEx message: count, min, avg, max,
+  then the buckets, each value as 3 bytes of 7 bits (LSB first, saturated at
+  2^21 - 1).
+
+  @param data : receives LATENCY_SYSEX_LEN bytes
+*/
+void latency_to_sysex(const latency_stats* stats, byte* data);
+
+#endif // B3_LATENCY_H
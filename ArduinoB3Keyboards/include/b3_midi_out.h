@@ -0,0 +1,56 @@
+// ===========================================================================
+// b3_midi_out.h
+// buffered MIDI output with running status
+// ===========================================================================
+#ifndef B3_MIDI_OUT_H
+#define B3_MIDI_OUT_H
+
+#include <Arduino.h>
+#include "b3_keyboards.h"
+#include "b3_note_queue.h"
+
+// room for a full note queue, every message with its status byte; layered keys
+// (see b3_keymap.h) may need more and make the buffer flush on its way
+#define MIDI_OUT_BUFFER_SIZE (NOTE_QUEUE_SIZE * 3)
+
+// after this much time without output, the next message carries its status byte
+// again so a receiver which (re)started in between gets in sync
+#define MIDI_OUT_RUNNING_STATUS_TIMEOUT_MS 250
+
+
+/*
+  Appends a note message to the output buffer. The status byte is omitted if it
+  is the same as the previous message's (MIDI running status).
+  The buffer is flushed first if it is full.
+
+  @param status   : NOTE_ON or NOTE_OFF with the MIDI channel
+  @param pitch    : note value
+  @param velocity : Note On velocity or Note Off release velocity
+*/
+void midi_out_note(byte status, byte pitch, byte velocity);
+
+
+/*
+  Appends a System Exclusive message to the output buffer. SysEx cancels
+  running status: the next note carries its status byte.
+  The buffer is flushed first if there is not enough room.
+
+  @param msg : whole message, F0 and F7 included
+  @param len : message length; at most MIDI_OUT_BUFFER_SIZE
+*/
+void midi_out_sysex(const byte* msg, unsigned int len);
+
+
+/*
+  Writes the buffered messages to the serial link in a single Serial.write().
+*/
+void midi_out_flush(void);
+
+
+/*
+  Number of bytes saved on the link by running status since power up, sent in
+  the KBD_CMD_SCAN_STATUS answer (see b3_rpi_cmd.h).
+*/
+unsigned long midi_out_bytes_saved(void);
+
+#endif // B3_MIDI_OUT_H
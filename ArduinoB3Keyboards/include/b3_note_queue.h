@@ -0,0 +1,64 @@
+// ===========================================================================
+// b3_note_queue.h
+// note events queue between the matrix scan interrupt and loop()
+// ===========================================================================
+#ifndef B3_NOTE_QUEUE_H
+#define B3_NOTE_QUEUE_H
+
+#include <Arduino.h>
+
+// number of note events the queue can hold; must be a power of two <= 128
+#define NOTE_QUEUE_SIZE 64
+
+// a key going down or up, as seen by the matrix scan; it is turned into MIDI
+// channel and pitch by loop(), through the key map (see b3_keymap.h)
+struct note_event {
+    byte key;       // 0..63 lower kb, 64..127 upper kb
+    byte on;        // Note On if true; Note Off otherwise
+    byte velocity;  // Note On velocity or Note Off release velocity
+#ifdef KBD_LATENCY_STATS
+    uint16_t scan_time;  // low 16 bits of micros() when the contact was seen
+#endif
+};
+
+
+/*
+  Resets the queue to its empty state, including the statistics counters.
+  Must not be called while the producer or the consumer are running.
+*/
+void note_queue_init(void);
+
+
+/*
+  Appends a note event to the queue. Single producer: only called from the
+  matrix scan interrupt.
+
+  @param ev : event to be copied into the queue
+  @return false if the queue is full and the event has been dropped
+*/
+bool note_queue_push(const note_event* ev);
+
+
+/*
+  Removes the oldest note event from the queue. Single consumer: only called
+  from loop().
+
+  @param ev : receives the event
+  @return false if the queue is empty
+*/
+bool note_queue_pop(note_event* ev);
+
+
+/*
+  Highest number of events ever waiting in the queue since note_queue_init().
+  Used to size NOTE_QUEUE_SIZE.
+*/
+byte note_queue_high_water(void);
+
+
+/*
+  Number of events dropped because the queue was full.
+*/
+unsigned int note_queue_overflows(void);
+
+#endif // B3_NOTE_QUEUE_H
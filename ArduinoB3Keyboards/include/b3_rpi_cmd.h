@@ -0,0 +1,87 @@
+// ===========================================================================
+// b3_rpi_cmd.h
+// commands received from the Raspberry PI
+// ===========================================================================
+#ifndef B3_RPI_CMD_H
+#define B3_RPI_CMD_H
+
+#include <Arduino.h>
+#include <B3Midi.h>
+#include "b3_keymap.h"
+
+// Commands are SysEx messages sent on the serial link:
+//
+//   F0 7D 4B <command> <data...> F7
+//
+// 7D is the non-commercial manufacturer ID (see B3Midi.h), 4B ('K') the
+// keyboards board.
+#define KBD_SYSEX_DEVICE_ID 0x4B
+
+// F0 7D 4B 01 <first key> { <chnl> <pitch> <flags> } ... F7
+// loads key map entries from <first key> on (see b3_keymap.h)
+#define KBD_CMD_KEY_MAP_SET 0x01
+
+// F0 7D 4B 02 F7
+// restores the default key map
+#define KBD_CMD_KEY_MAP_DEFAULT 0x02
+
+// F0 7D 4B 03 <curve> F7
+// selects the velocity curve (see b3_velocity.h)
+#define KBD_CMD_VELOCITY_CURVE 0x03
+
+// F0 7D 4B 04 F7
+// asks for the keys currently down; the board answers with
+// F0 7D 4B 04 <key state> F7
+#define KBD_CMD_KEY_STATE_DUMP 0x04
+
+// F0 7D 4B 05 <key state> F7
+// the Raspberry PI sends the keys it believes are down; the board sends the
+// Note On/Off needed to bring it in line with the actual keys
+#define KBD_CMD_KEY_STATE_SYNC 0x05
+
+// F0 7D 4B 06 F7
+// asks for the scan engine status; the board answers with
+// F0 7D 4B 06 <idle> <period lsb> <period msb> <timeout lsb> <timeout msb>
+//             <queue high water> <queue overflows> <saved 0> <saved 1> <saved 2> F7
+// idle is 1 when scanning at the idle rate, period the column period in us,
+// timeout the idle timeout in ms; 14-bit values are sent 7 bits per byte and
+// the overflows count is clipped to 127. saved is the number of status bytes
+// left out by running status since startup (see b3_midi_out.h), 3 bytes of 7
+// bits, LSB first (see putSysExCount())
+#define KBD_CMD_SCAN_STATUS 0x06
+
+// F0 7D 4B 07 <timeout lsb> <timeout msb> F7
+// sets the idle timeout in ms (see set_idle_timeout())
+#define KBD_CMD_IDLE_TIMEOUT 0x07
+
+// F0 7D 4B 08 F7
+// asks for the latency statistics (KBD_LATENCY_STATS builds only); the board
+// answers with three messages, see b3_latency.h for <stats>:
+// F0 7D 4B 08 00 <stats> F7 : note latency
+// F0 7D 4B 08 01 <stats> F7 : scan jitter
+// F0 7D 4B 08 02 <stats> F7 : column scan time
+#define KBD_CMD_LATENCY_REPORT 0x08
+
+// F0 7D 4B 09 F7
+// clears the latency statistics (KBD_LATENCY_STATS builds only)
+#define KBD_CMD_LATENCY_RESET 0x09
+
+// <key state> is a bitmap of the KEY_MAP_SIZE keys packed 7 bits per byte:
+// key k is bit (k % 7) of byte (k / 7)
+#define KEY_STATE_SYSEX_LEN ((KEY_MAP_SIZE + 6) / 7)
+
+// longest command: a key map block of RPI_CMD_MAX_KEYS entries
+#define RPI_CMD_MAX_KEYS 32
+#define RPI_CMD_BUFFER_SIZE (5 + 3 * RPI_CMD_MAX_KEYS)
+
+
+/*
+  Reads the bytes received from the Raspberry PI and runs the command once a
+  whole SysEx message is in. Never waits for the link: a message can come in
+  over several calls to loop().
+  Anything which is not a SysEx message for this board is ignored; so are
+  messages longer than RPI_CMD_BUFFER_SIZE.
+*/
+void on_rpi_cmd(void);
+
+#endif // B3_RPI_CMD_H
@@ -0,0 +1,51 @@
+// ===========================================================================
+// b3_velocity.h
+// key velocity curves
+// ===========================================================================
+#ifndef B3_VELOCITY_H
+#define B3_VELOCITY_H
+
+#include <Arduino.h>
+
+// available velocity curves
+#define VELOCITY_CURVE_LINEAR 0  // velocity decreases linearly with the contacts delta
+#define VELOCITY_CURVE_SOFT 1    // loud notes are easier to play
+#define VELOCITY_CURVE_HARD 2    // loud notes need a fast key stroke
+#define VELOCITY_CURVE_FIXED 3   // always VELOCITY_MAX, as a genuine B3
+#define VELOCITY_NB_CURVES 4
+
+// curve used after power up
+#ifndef KBD_VELOCITY_CURVE
+#define KBD_VELOCITY_CURVE VELOCITY_CURVE_LINEAR
+#endif
+
+// Contacts deltas are quantized in VELOCITY_DELTA_STEP_US steps; deltas longer
+// than VELOCITY_TABLE_SIZE steps (32.8 ms) give the lowest velocity (1).
+#define VELOCITY_TABLE_SIZE 128
+#define VELOCITY_DELTA_STEP_US 256
+
+
+/*
+  Selects the curve used by velocity_from_delta().
+
+  @param curve : one of VELOCITY_CURVE_xxx; ignored if out of range
+*/
+void set_velocity_curve(byte curve);
+
+
+/*
+  Returns the selected curve.
+*/
+byte get_velocity_curve(void);
+
+
+/*
+  Converts the time between two contacts of a key into a MIDI velocity.
+  Used for both the break->make (Note On) and make->break (Note Off) deltas.
+
+  @param delta_us : contacts delta in microseconds
+  @return velocity in the [1..127] range
+*/
+byte velocity_from_delta(unsigned long delta_us);
+
+#endif // B3_VELOCITY_H
@@ -0,0 +1,396 @@
+#include "b3_keyboards.h"
+#include "b3_midi_out.h"
+#include "b3_note_queue.h"
+#include "sim-mocks_Matrix.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/******************************************************************
+  Keyboards scan engine trace replay.
+
+  A trace is a text file of switch states, one record per line:
+
+      <time_us> <column> <switches>
+
+  switches is the 32-bit word of the column (same layout as the
+  look_for_changes() values, 0x prefix for hexadecimal); it stays
+  on the matrix until the next record for that column. Empty lines
+  and lines starting with '#' are ignored. Records must be sorted
+  by time.
+
+  A record may also carry bytes the Raspberry PI sends to the board
+  (hexadecimal, no prefix), written to the Serial receive buffer at
+  that time:
+
+      <time_us> rx <byte> <byte> ...
+
+  or the time loop() takes from then on, after the scan interrupt
+  (0 by default; the next column is scanned on time regardless):
+
+      <time_us> loop <us>
+
+  The firmware setup() is run once, then scan_next_column() and
+  loop() are called every column period of simulated time (the
+  fast or the idle one, as selected by the firmware), as the TCB0
+  interrupt and the main loop would on the board.
+
+  Every MIDI message written to Serial is logged as:
+
+      <time_us> <message bytes, status included>
+
+  --expect <file> compares that log with a reference one.
+ ******************************************************************/
+
+// firmware entry points, defined in b3_keyboards.cpp
+void setup();
+void loop();
+
+USING_NAMESPACE_SIM_MOCKS
+
+// full scans simulated after the last trace record
+static const unsigned long TAIL_FULL_SCANS = 4;
+
+struct trace_record {
+    unsigned long time_us;
+    byte column;
+    unsigned long switches;
+    std::vector<byte> rx;  // when not empty, the record is Serial input only
+    long loop_us = -1;     // when set, the record is the loop() duration only
+};
+
+struct replay_stats {
+    unsigned long column_scans = 0;
+    unsigned long idle_rate_scans = 0;
+    unsigned long sim_us = 0;
+    unsigned long busy_scans = 0;
+    unsigned long messages = 0;
+    unsigned long note_on = 0;
+    unsigned long note_off = 0;
+    unsigned long wire_bytes = 0;
+    double busy_ns = 0;
+    double idle_ns = 0;
+};
+
+
+static bool load_trace(const char* path, std::vector<trace_record>* records) {
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open trace %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int line_nb = 0;
+    unsigned long last_time = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_nb++;
+
+        char* p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+
+        trace_record rec;
+        char* end;
+
+        rec.time_us = strtoul(p, &end, 0);
+        unsigned long column = 0;
+        rec.switches = 0;
+
+        char* rx = end;
+        while (*rx == ' ' || *rx == '\t')
+            rx++;
+
+        if (strncmp(rx, "rx", 2) == 0) {
+            end = rx + 2;
+            for (;;) {
+                char* next;
+                unsigned long b = strtoul(end, &next, 16);
+                if (next == end)
+                    break;
+                rec.rx.push_back((byte)b);
+                end = next;
+            }
+            if (rec.rx.empty())
+                end = p;
+        } else if (strncmp(rx, "loop", 4) == 0) {
+            char* next;
+            rec.loop_us = strtol(rx + 4, &next, 0);
+            end = next == rx + 4 || rec.loop_us < 0 ? p : next;
+        } else {
+            column = strtoul(end, &end, 0);
+            rec.switches = strtoul(end, &end, 0) & 0xFFFFFFFFUL;
+        }
+
+        if (end == p || column >= MATRIX_NB_COLS || rec.time_us < last_time) {
+            fprintf(stderr, "%s:%d: invalid or unsorted record\n", path, line_nb);
+            fclose(f);
+            return false;
+        }
+
+        rec.column = (byte)column;
+        last_time = rec.time_us;
+        records->push_back(rec);
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+/*
+  Splits the bytes written to Serial into MIDI messages (running status
+  expanded) and appends them to the log.
+*/
+static void collect_midi(unsigned long now, std::vector<std::string>* log, replay_stats* stats) {
+
+    static byte status = 0;
+    static byte data[2];
+    static int data_len = 0;
+    static std::string sysex;
+
+    while (Serial.mTxBuffer.getLength() > 0) {
+
+        byte b = Serial.mTxBuffer.read();
+        stats->wire_bytes++;
+
+        char text[8];
+
+        if (b == 0xF0) {
+            sysex = "F0";
+            status = 0xF0;
+            continue;
+        }
+
+        if (status == 0xF0) {
+            snprintf(text, sizeof(text), " %02X", b);
+            sysex += text;
+            if (b == 0xF7) {
+                char stamp[16];
+                snprintf(stamp, sizeof(stamp), "%lu ", now);
+                log->push_back(stamp + sysex);
+                stats->messages++;
+                status = 0;
+            }
+            continue;
+        }
+
+        if (b & 0x80) {
+            status = b;
+            data_len = 0;
+            continue;
+        }
+
+        if (status == 0)
+            continue;  // data byte without status: dropped, as a receiver would
+
+        data[data_len++] = b;
+
+        int expected = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+        if (data_len < expected)
+            continue;
+
+        char msg[64];
+        if (expected == 1)
+            snprintf(msg, sizeof(msg), "%lu %02X %02X", now, status, data[0]);
+        else
+            snprintf(msg, sizeof(msg), "%lu %02X %02X %02X", now, status, data[0], data[1]);
+
+        log->push_back(msg);
+        stats->messages++;
+
+        if ((status & 0xF0) == NOTE_ON && data[1] != 0)
+            stats->note_on++;
+        else if ((status & 0xF0) == NOTE_ON || (status & 0xF0) == NOTE_OFF)
+            stats->note_off++;
+
+        data_len = 0;
+    }
+}
+
+
+static void replay(const std::vector<trace_record>& records, std::vector<std::string>* log, replay_stats* stats) {
+
+    typedef std::chrono::steady_clock clock;
+
+    unsigned long end_time = records.empty() ? 0 : records.back().time_us;
+    end_time += TAIL_FULL_SCANS * MATRIX_NB_COLS * KBD_COLUMN_PERIOD_US;
+
+    size_t next = 0;
+
+    // period the current column scan has come after
+    unsigned int period_us = KBD_COLUMN_PERIOD_US;
+
+    // simulated time loop() takes after the scan interrupt
+    unsigned long loop_us = 0;
+
+    for (unsigned long now = 0; now <= end_time; now += period_us) {
+
+        while (next < records.size() && records[next].time_us <= now) {
+            const trace_record& rec = records[next];
+            if (rec.loop_us >= 0)
+                loop_us = rec.loop_us;
+            else if (rec.rx.empty())
+                Matrix.setColumn(rec.column, rec.switches);
+            else
+                Serial.mRxBuffer.write(rec.rx.data(), (int)rec.rx.size());
+            next++;
+        }
+
+        Clock.setMicros(now);
+
+        size_t logged = log->size();
+
+        clock::time_point start = clock::now();
+        scan_next_column();
+        Clock.setMicros(now + loop_us);
+        loop();
+        clock::time_point stop = clock::now();
+
+        collect_midi(now + loop_us, log, stats);
+
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+
+        stats->column_scans++;
+        if (period_us != KBD_COLUMN_PERIOD_US)
+            stats->idle_rate_scans++;
+
+        stats->sim_us = now;
+        period_us = get_column_period_us();
+
+        if (log->size() != logged) {
+            stats->busy_scans++;
+            stats->busy_ns += ns;
+        } else {
+            stats->idle_ns += ns;
+        }
+    }
+}
+
+
+static bool compare_log(const char* path, const std::vector<std::string>& log) {
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open expected output %s\n", path);
+        return false;
+    }
+
+    std::vector<std::string> expected;
+    char line[512];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        std::string s(line);
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r' || s.back() == ' '))
+            s.pop_back();
+        if (!s.empty() && s[0] != '#')
+            expected.push_back(s);
+    }
+    fclose(f);
+
+    bool same = true;
+    size_t n = std::max(expected.size(), log.size());
+
+    for (size_t i = 0; i < n; i++) {
+        const char* exp = i < expected.size() ? expected[i].c_str() : "<none>";
+        const char* got = i < log.size() ? log[i].c_str() : "<none>";
+        if (strcmp(exp, got) != 0) {
+            fprintf(stderr, "message %zu: expected '%s', got '%s'\n", i, exp, got);
+            same = false;
+        }
+    }
+
+    return same;
+}
+
+
+static void print_report(size_t nb_records, const replay_stats& stats) {
+
+    unsigned long idle_scans = stats.column_scans - stats.busy_scans;
+    double sim_seconds = stats.sim_us / 1e6;
+    unsigned long events = stats.note_on + stats.note_off;
+
+    printf("--- replay report ---\n");
+    printf("trace records          : %zu\n", nb_records);
+    printf("simulated time         : %.3f ms (%lu column scans, %lu at the idle rate)\n",
+           sim_seconds * 1e3, stats.column_scans, stats.idle_rate_scans);
+    printf("MIDI messages          : %lu (note on %lu, note off %lu)\n",
+           stats.messages, stats.note_on, stats.note_off);
+    printf("wire bytes             : %lu (running status saved %lu)\n",
+           stats.wire_bytes, midi_out_bytes_saved());
+    printf("note queue high water  : %u (overflows %u)\n",
+           note_queue_high_water(), note_queue_overflows());
+
+    if (events > 0) {
+        printf("events per second      : %.0f simulated, %.0f host\n",
+               events / sim_seconds, events / (stats.busy_ns / 1e9));
+        printf("cost per event         : %.0f ns\n", stats.busy_ns / events);
+    }
+
+    if (idle_scans > 0)
+        printf("cost per idle column   : %.0f ns\n", stats.idle_ns / idle_scans);
+}
+
+
+static void usage(const char* name) {
+
+    fprintf(stderr, "usage: %s [--quiet] [--expect <midi log>] <trace>\n", name);
+}
+
+
+int main(int argc, char** argv) {
+
+    const char* trace_path = NULL;
+    const char* expect_path = NULL;
+    bool quiet = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quiet") == 0)
+            quiet = true;
+        else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc)
+            expect_path = argv[++i];
+        else if (argv[i][0] != '-' && trace_path == NULL)
+            trace_path = argv[i];
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (trace_path == NULL) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<trace_record> records;
+    if (!load_trace(trace_path, &records))
+        return 2;
+
+    setup();
+
+    std::vector<std::string> log;
+    replay_stats stats;
+    replay(records, &log, &stats);
+
+    if (!quiet) {
+        for (size_t i = 0; i < log.size(); i++)
+            printf("%s\n", log[i].c_str());
+    }
+
+    print_report(records.size(), stats);
+
+    if (expect_path != NULL && !compare_log(expect_path, log)) {
+        fprintf(stderr, "MIDI output differs from %s\n", expect_path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include "Arduino.h"
+#include "sim-mocks_Matrix.h"
+
+SIM_MOCKS_NAMESPACE::SerialMock<SIM_SERIAL_BUFFER_SIZE> Serial;
+
+void pinMode(uint8_t inPin, uint8_t inMode)
+{
+    SIM_MOCKS_NAMESPACE::Matrix.pinMode(inPin, inMode);
+}
+
+void digitalWrite(uint8_t inPin, uint8_t inValue)
+{
+    SIM_MOCKS_NAMESPACE::Matrix.digitalWrite(inPin, inValue);
+}
+
+int digitalRead(uint8_t inPin)
+{
+    return SIM_MOCKS_NAMESPACE::Matrix.digitalRead(inPin);
+}
+
+unsigned long micros()
+{
+    return SIM_MOCKS_NAMESPACE::Clock.micros();
+}
+
+unsigned long millis()
+{
+    return SIM_MOCKS_NAMESPACE::Clock.millis();
+}
+
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// Minimal Arduino API for the host build of the keyboards firmware.
+// Pins, time and Serial are routed to the sim-mocks objects.
+
+#include "sim-mocks_SerialMock.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT           0x0
+#define OUTPUT          0x1
+#define INPUT_PULLUP    0x2
+
+// Arduino Nano Every analog pins
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#define F(str) (str)
+
+void pinMode(uint8_t inPin, uint8_t inMode);
+void digitalWrite(uint8_t inPin, uint8_t inValue);
+int digitalRead(uint8_t inPin);
+
+unsigned long micros();
+unsigned long millis();
+
+void noInterrupts();
+void interrupts();
+
+#define SIM_SERIAL_BUFFER_SIZE 4096
+extern SIM_MOCKS_NAMESPACE::SerialMock<SIM_SERIAL_BUFFER_SIZE> Serial;
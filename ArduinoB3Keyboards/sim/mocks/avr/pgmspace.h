@@ -0,0 +1,13 @@
+#pragma once
+
+// On the host, flash tables are plain const data.
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+
+#define memcpy_P(dest, src, size) memcpy((dest), (src), (size))
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "sim-mocks_Namespace.h"
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+END_SIM_MOCKS_NAMESPACE
@@ -0,0 +1,139 @@
+#include "sim-mocks_Matrix.h"
+#include "b3_keyboards.h"
+#include <string.h>
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+MatrixMock  Matrix;
+ClockMock   Clock;
+
+// -----------------------------------------------------------------------------
+
+MatrixMock::MatrixMock()
+{
+    clear();
+}
+
+MatrixMock::~MatrixMock()
+{
+}
+
+// -----------------------------------------------------------------------------
+
+void MatrixMock::pinMode(uint8_t inPin, uint8_t inMode)
+{
+    if (inPin < sNbPins)
+    {
+        mPinMode[inPin] = inMode;
+    }
+}
+
+void MatrixMock::digitalWrite(uint8_t inPin, uint8_t inValue)
+{
+    if (inPin < sNbPins)
+    {
+        mPinValue[inPin] = inValue ? HIGH : LOW;
+    }
+}
+
+int MatrixMock::digitalRead(uint8_t inPin) const
+{
+    const int column = getSelectedColumn();
+    if (column < 0)
+    {
+        return LOW;
+    }
+
+    const uint32_t switches = mSwitches[column];
+    const uint8_t mux = getMuxAddress();
+
+    int bit;
+    switch (inPin)
+    {
+        case MKB: bit = mux * 2;            break;
+        case BRB: bit = mux * 2 + 1;        break;
+        case MKA: bit = 16 + mux * 2;       break;
+        case BRA: bit = 16 + mux * 2 + 1;   break;
+        default:  return inPin < sNbPins ? mPinValue[inPin] : LOW;
+    }
+
+    return (switches >> bit) & 1 ? HIGH : LOW;
+}
+
+// -----------------------------------------------------------------------------
+
+void MatrixMock::setColumn(uint8_t inColumn, uint32_t inSwitches)
+{
+    if (inColumn < sNbColumns)
+    {
+        mSwitches[inColumn] = inSwitches;
+    }
+}
+
+uint32_t MatrixMock::getColumn(uint8_t inColumn) const
+{
+    return inColumn < sNbColumns ? mSwitches[inColumn] : 0;
+}
+
+void MatrixMock::clear()
+{
+    memset(mPinMode, INPUT, sizeof(mPinMode));
+    memset(mPinValue, LOW, sizeof(mPinValue));
+    memset(mSwitches, 0, sizeof(mSwitches));
+}
+
+// -----------------------------------------------------------------------------
+
+int MatrixMock::getSelectedColumn() const
+{
+    static const uint8_t columns[sNbColumns] = { T0, T1, T2, T3, T4, T5, T6, T7 };
+
+    int selected = -1;
+    for (int i = 0; i < sNbColumns; ++i)
+    {
+        if (mPinValue[columns[i]] == HIGH)
+        {
+            if (selected >= 0)
+            {
+                return -1; // several columns driven: nothing readable
+            }
+            selected = i;
+        }
+    }
+    return selected;
+}
+
+uint8_t MatrixMock::getMuxAddress() const
+{
+    return (mPinValue[MUX_A1] ? 1 : 0)
+         | (mPinValue[MUX_A2] ? 2 : 0)
+         | (mPinValue[MUX_A3] ? 4 : 0);
+}
+
+// =============================================================================
+
+ClockMock::ClockMock()
+    : mMicros(0)
+{
+}
+
+ClockMock::~ClockMock()
+{
+}
+
+unsigned long ClockMock::micros() const
+{
+    return mMicros;
+}
+
+unsigned long ClockMock::millis() const
+{
+    return mMicros / 1000;
+}
+
+void ClockMock::setMicros(unsigned long inMicros)
+{
+    mMicros = inMicros;
+}
+
+END_SIM_MOCKS_NAMESPACE
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "sim-mocks.h"
+#include <inttypes.h>
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+/*
+  Emulates the Fatar keyboards matrix as seen from the Nano Every pins:
+  the column is the T[7:0] line driven high, the multiplexer address comes
+  from MUX_A[3:1], and BRA/BRB/MKA/MKB return the matching bits of the column
+  32-bit switches word (same layout as look_for_changes() values).
+*/
+class MatrixMock
+{
+public:
+     MatrixMock();
+    ~MatrixMock();
+
+public: // Arduino pins API
+    void pinMode(uint8_t inPin, uint8_t inMode);
+    void digitalWrite(uint8_t inPin, uint8_t inValue);
+    int digitalRead(uint8_t inPin) const;
+
+public: // Test Helpers API
+    void setColumn(uint8_t inColumn, uint32_t inSwitches);
+    uint32_t getColumn(uint8_t inColumn) const;
+    void clear();
+
+private:
+    int getSelectedColumn() const;
+    uint8_t getMuxAddress() const;
+
+private:
+    static const int sNbPins    = 22;
+    static const int sNbColumns = 8;
+
+    uint8_t mPinMode[sNbPins];
+    uint8_t mPinValue[sNbPins];
+    uint32_t mSwitches[sNbColumns];
+};
+
+// -----------------------------------------------------------------------------
+
+/*
+  Simulated time, driven by the trace replay.
+*/
+class ClockMock
+{
+public:
+     ClockMock();
+    ~ClockMock();
+
+public: // Arduino time API
+    unsigned long micros() const;
+    unsigned long millis() const;
+
+public: // Test Helpers API
+    void setMicros(unsigned long inMicros);
+
+private:
+    unsigned long mMicros;
+};
+
+extern MatrixMock   Matrix;
+extern ClockMock    Clock;
+
+END_SIM_MOCKS_NAMESPACE
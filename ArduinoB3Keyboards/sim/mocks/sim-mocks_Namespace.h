@@ -0,0 +1,11 @@
+#pragma once
+
+#define SIM_MOCKS_NAMESPACE             sim_mocks
+#define BEGIN_SIM_MOCKS_NAMESPACE       namespace SIM_MOCKS_NAMESPACE {
+#define END_SIM_MOCKS_NAMESPACE         }
+
+#define USING_NAMESPACE_SIM_MOCKS       using namespace SIM_MOCKS_NAMESPACE;
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+END_SIM_MOCKS_NAMESPACE
@@ -0,0 +1,5 @@
+#include "sim-mocks_SerialMock.h"
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+END_SIM_MOCKS_NAMESPACE
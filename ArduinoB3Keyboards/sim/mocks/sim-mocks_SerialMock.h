@@ -0,0 +1,61 @@
+#pragma once
+
+#include "sim-mocks.h"
+#include <inttypes.h>
+#include <stddef.h>
+
+BEGIN_SIM_MOCKS_NAMESPACE
+
+template<typename DataType, int Size>
+class RingBuffer
+{
+public:
+     RingBuffer();
+    ~RingBuffer();
+
+public:
+    int getLength() const;
+    bool isEmpty() const;
+
+public:
+    void write(DataType inData);
+    void write(const DataType* inData, int inSize);
+    void clear();
+
+public:
+    DataType peek() const;
+    DataType read();
+    void read(DataType* outData, int inSize);
+
+private:
+    DataType mData[Size];
+    DataType* mWriteHead;
+    DataType* mReadHead;
+};
+
+template<int BufferSize>
+class SerialMock
+{
+public:
+     SerialMock();
+    ~SerialMock();
+
+public: // Arduino Serial API
+    void begin(long inBaudrate);
+    int available() const;
+    int read();
+    size_t write(uint8_t inData);
+    size_t write(const uint8_t* inData, size_t inSize);
+    void flush();
+
+public:
+    typedef RingBuffer<uint8_t, BufferSize> Buffer;
+    Buffer mTxBuffer;
+    Buffer mRxBuffer;
+    long mBaudrate;
+    unsigned long mWriteCalls;
+};
+
+END_SIM_MOCKS_NAMESPACE
+
+#include "sim-mocks_SerialMock.hpp"
@@ -1,7 +1,17 @@
 #include "b3_keyboards.h"
+#include "b3_keymap.h"
+#include "b3_latency.h"
+#include "b3_midi_out.h"
+#include "b3_note_queue.h"
+#include "b3_rpi_cmd.h"
+#include "b3_velocity.h"
 #include <Arduino.h>
 #include <avr/sleep.h>
 
+#ifdef __AVR_ATmega4809__
+#include <util/delay.h>
+#endif
+
 /******************************************************************
               SetBfree Keyboards Control Firmware
                       Arduino Nano Every.
@@ -11,12 +21,23 @@
   Each key contact is made of two switches: when a key is pressed
   the break switch is closed first, then the make switch closes.
   Measuring the delta timing between both events gives information
-  about the key velocity. Although the velocity is not taken into
-  account in the organ emulation, reading the state of both switches
-  is used to implement debouncing.
+  about the key velocity, which is sent with the Note On (see
+  b3_velocity.h for the curves). Reading the state of both switches
+  is also used to implement debouncing.
 
   Pedals control is no more necessary since I have bought a pedalboard
   from PedaMidiKit which produces MIDI messages by its own.
+
+  The matrix is scanned one column at a time from a TCB0 periodic
+  interrupt. Note events are passed to loop() through a lock-free
+  queue; loop() only writes them to the serial link, so a slow link
+  never delays the scan. All the notes found since the previous pass
+  of loop() (a chord, a glissando step) leave in a single buffered
+  write using MIDI running status (see b3_midi_out.h).
+
+  The scan only knows key numbers; loop() looks them up in the key
+  map (see b3_keymap.h) which the Raspberry PI can reload at any
+  time to set up splits, transpositions or coupled manuals.
  ******************************************************************/
 
 
@@ -24,19 +45,61 @@
 // snapshot value of all keyboards switches (KEYBOARDS_NB_PINS)
 static unsigned long old_value_g[MATRIX_NB_COLS];
 
-static byte note_on_sent_g[KEYBOARDS_NB_PINS / 8];
-static byte note_off_sent_g[KEYBOARDS_NB_PINS / 8];
+// Note On/Off debouncing state, one word per column with the same layout as
+// old_value_g; only the make contact bits (even bits) are used.
+static unsigned long note_on_sent_g[MATRIX_NB_COLS];
+static unsigned long note_off_sent_g[MATRIX_NB_COLS];
+
+// per key contact timestamp (micros()): break closing time while the key goes
+// down, make opening time while it goes up. 16 bits would wrap after 65.5 ms
+// and turn a very slow stroke into a fast one.
+static unsigned long key_time_g[KEYBOARDS_NB_PINS / 2];
+
+// time of the column scan being processed
+static unsigned long event_time_g;
+
+// key map entry each key has sent its last Note On with, so that the matching
+// Note Off goes to the same channel and pitch even if the map changed meanwhile
+static key_map_entry playing_g[KEY_MAP_SIZE];
+
+// adaptive scan rate (see KBD_IDLE_TIMEOUT_MS); the period is read by loop()
+static volatile unsigned int column_period_us_g = KBD_COLUMN_PERIOD_US;
+static unsigned int idle_timeout_ms_g = KBD_IDLE_TIMEOUT_MS;
+static volatile uint16_t idle_after_scans_g;
+
+#ifdef KBD_LATENCY_STATS
+// note latency is written by loop(), scan jitter and column scan time by the
+// scan interrupt
+static latency_stats note_latency_g;
+static latency_stats scan_jitter_g;
+static latency_stats column_scan_g;
+#endif
+
+// keys whose Note On has been sent to the Raspberry PI and not their Note Off yet
+static byte sounding_g[KEY_MAP_SIZE / 8];
+
+static void set_column_period(unsigned int period_us);
+static void stamp_keys(unsigned long keys, byte col);
+static void send_keys(unsigned long keys, byte col, bool on);
 
 void setup() {
 
-    // keep keyboards alive
-    sleep_disable();
+    // loop() sleeps until the next interrupt once it has nothing left to do;
+    // the idle mode keeps the timers and the serial link running
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
 
     setup_keyboards_ctrl_pins();
 
     init_keyboards();
 
     Serial.begin(115200);
+
+#ifdef KBD_SCAN_BENCHMARK
+    report_scan_benchmark();
+#endif
+
+    setup_scan_timer();
 }
 
 
@@ -80,44 +143,298 @@ void init_keyboards(void) {
     for (int column = 0; column < MATRIX_NB_COLS; column++) {
         // default buttons state is: released
         old_value_g[column] = 0x00000000;
-    }
 
-    for (int i = 0; i < KEYBOARDS_NB_PINS / 8; i++) {
-        note_on_sent_g[i] = 0x00;
-        note_off_sent_g[i] = 0x00;
+        note_on_sent_g[column] = 0x00000000;
+        note_off_sent_g[column] = 0x00000000;
     }
+
+    for (int key = 0; key < KEYBOARDS_NB_PINS / 2; key++)
+        key_time_g[key] = 0;
+
+    set_idle_timeout(KBD_IDLE_TIMEOUT_MS);
+    column_period_us_g = KBD_COLUMN_PERIOD_US;
+
+    key_map_init();
+
+    for (byte key = 0; key < KEY_MAP_SIZE; key++)
+        playing_g[key] = *key_map_get(key);
+
+    for (byte i = 0; i < KEY_MAP_SIZE / 8; i++)
+        sounding_g[i] = 0;
+
+    note_queue_init();
+
+#ifdef KBD_LATENCY_STATS
+    reset_latency_stats();
+#endif
 }
 
+
+void setup_scan_timer(void) {
+
+#ifdef __AVR_ATmega4809__
+    // TCB0 is set up for PWM on D6 by the Arduino core; D6 is MUX_A2 here.
+    TCB0.CTRLA = 0;
+    TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB0.CNT = 0;
+    TCB0.CCMP = (F_CPU / 1000000UL) * column_period_us_g - 1;
+    TCB0.INTFLAGS = TCB_CAPT_bm;
+    TCB0.INTCTRL = TCB_CAPT_bm;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+#endif
+}
+
+
+#ifdef __AVR_ATmega4809__
+ISR(TCB0_INT_vect) {
+
+    TCB0.INTFLAGS = TCB_CAPT_bm;
+    scan_next_column();
+
+#ifdef KBD_LATENCY_STATS
+    // TCB0 restarted from 0 at the compare match which raised this interrupt;
+    // if the scan outlasted the period, it wrapped and raised the next one
+    unsigned int scan_us = TCB0.CNT / (F_CPU / 1000000UL);
+    if (TCB0.INTFLAGS & TCB_CAPT_bm)
+        scan_us += column_period_us_g;
+    latency_record(&column_scan_g, scan_us);
+#endif
+}
+#endif
+
 void loop() {
 
-    static unsigned long time = 0;
-    static unsigned int active_column = 0;
+    on_rpi_cmd();
 
-    if (time == 0)
-        time = micros();
+    note_event ev;
 
-    unsigned long curTime = micros();
+#ifdef KBD_LATENCY_STATS
+    // scan times of the notes written by this pass
+    uint16_t scan_times[NOTE_QUEUE_SIZE];
+    byte nb_notes = 0;
+#endif
 
-    // if 100us have elapsed, select a new Fatar keyboard matrix column
-    if (curTime > time + 100) {
-        select_keyboard_column(active_column);
+    // write the queued notes to the Raspberry PI
+    while (note_queue_pop(&ev)) {
+        play_key(&ev);
+#ifdef KBD_LATENCY_STATS
+        if (nb_notes < NOTE_QUEUE_SIZE)
+            scan_times[nb_notes++] = ev.scan_time;
+#endif
+    }
+
+    midi_out_flush();
 
-        // read all switches of both keyboards at a time
-        byte switches[4];
-        read_all_switches(switches);
+#ifdef KBD_LATENCY_STATS
+    uint16_t written = (uint16_t)micros();
+    for (byte i = 0; i < nb_notes; i++)
+        latency_record(&note_latency_g, written - scan_times[i]);
+#endif
 
-        look_for_changes(switches, active_column);
+    // woken up by the next scan interrupt at the latest; an event queued after
+    // the queue was found empty waits at most one column period
+    sleep_cpu();
+}
 
-        time = curTime;
 
-        if (++active_column >= MATRIX_NB_COLS)
-            active_column = 0;
+void play_key(const note_event* ev) {
+
+    // a Note On takes the current mapping, a Note Off the one its Note On had
+    if (ev->on) {
+        playing_g[ev->key] = *key_map_get(ev->key);
+        sounding_g[ev->key / 8] |= 1 << (ev->key % 8);
+    } else {
+        sounding_g[ev->key / 8] &= ~(1 << (ev->key % 8));
     }
+
+    const key_map_entry* entry = &playing_g[ev->key];
+
+    if (entry->flags & KEY_MUTED)
+        return;
+
+    send_note(entry->chnl, entry->pitch, ev->on, ev->velocity);
+
+    if (entry->flags & KEY_LAYERED)
+        send_note(entry->flags & KEY_LAYER_CHNL, entry->pitch, ev->on, ev->velocity);
+}
+
+
+void scan_next_column(void) {
+
+    static byte active_column = 0;
+
+    // full scans with all the contacts open, and whether one was closed in
+    // the current full scan
+    static uint16_t quiet_scans = 0;
+    static bool active = false;
+
+#ifdef KBD_LATENCY_STATS
+    static bool first_scan = true;
+    static uint16_t last_scan_us;
+
+    // column_period_us_g is still the period this interval was programmed with
+    uint16_t scan_us = (uint16_t)micros();
+    if (!first_scan) {
+        int16_t jitter = (int16_t)(scan_us - last_scan_us - column_period_us_g);
+        latency_record(&scan_jitter_g, jitter < 0 ? -jitter : jitter);
+    }
+    first_scan = false;
+    last_scan_us = scan_us;
+#endif
+
+    select_keyboard_column(active_column);
+
+    // read all switches of both keyboards at a time
+    byte switches[4];
+    read_all_switches(switches);
+
+    look_for_changes(switches, active_column);
+
+    if (old_value_g[active_column] != 0) {
+        active = true;
+        if (column_period_us_g != KBD_COLUMN_PERIOD_US)
+            set_column_period(KBD_COLUMN_PERIOD_US);
+    }
+
+    if (++active_column >= MATRIX_NB_COLS) {
+        active_column = 0;
+
+        if (active)
+            quiet_scans = 0;
+        else if (quiet_scans < 0xFFFF)
+            quiet_scans++;
+
+        active = false;
+
+        if (idle_after_scans_g != 0 && quiet_scans >= idle_after_scans_g
+                && column_period_us_g != KBD_IDLE_COLUMN_PERIOD_US)
+            set_column_period(KBD_IDLE_COLUMN_PERIOD_US);
+    }
+}
+
+
+/*
+  Called from the scan interrupt, with the counter counting since the
+  interrupt was raised. If the interrupt has run longer than a new, shorter
+  period, the counter is already past the new compare value and would only
+  match it after wrapping at 0xFFFF (4 ms at 16 MHz): it is restarted
+  instead, delaying that column by the time already spent.
+*/
+static void set_column_period(unsigned int period_us) {
+
+    column_period_us_g = period_us;
+
+#ifdef __AVR_ATmega4809__
+    uint16_t ccmp = (F_CPU / 1000000UL) * period_us - 1;
+
+    TCB0.CCMP = ccmp;
+    if (TCB0.CNT >= ccmp)
+        TCB0.CNT = 0;
+#endif
+}
+
+
+#ifdef KBD_LATENCY_STATS
+void report_latency_stats(void) {
+
+    byte msg[6 + LATENCY_SYSEX_LEN];
+
+    msg[0] = SYSEX_START;
+    msg[1] = SYSEX_NON_COMMERCIAL_ID;
+    msg[2] = KBD_SYSEX_DEVICE_ID;
+    msg[3] = KBD_CMD_LATENCY_REPORT;
+    msg[5 + LATENCY_SYSEX_LEN] = SYSEX_END;
+
+    msg[4] = 0;
+    latency_to_sysex(&note_latency_g, &msg[5]);
+    midi_out_sysex(msg, sizeof(msg));
+
+    noInterrupts();
+    latency_stats jitter = scan_jitter_g;
+    interrupts();
+
+    msg[4] = 1;
+    latency_to_sysex(&jitter, &msg[5]);
+    midi_out_sysex(msg, sizeof(msg));
+
+    noInterrupts();
+    latency_stats column_scan = column_scan_g;
+    interrupts();
+
+    msg[4] = 2;
+    latency_to_sysex(&column_scan, &msg[5]);
+    midi_out_sysex(msg, sizeof(msg));
+}
+
+
+void reset_latency_stats(void) {
+
+    latency_reset(&note_latency_g, NOTE_LATENCY_BUCKET_SHIFT);
+
+    noInterrupts();
+    latency_reset(&scan_jitter_g, SCAN_JITTER_BUCKET_SHIFT);
+    latency_reset(&column_scan_g, COLUMN_SCAN_BUCKET_SHIFT);
+    interrupts();
+}
+#endif
+
+
+unsigned int get_column_period_us(void) {
+
+    noInterrupts();
+    unsigned int period_us = column_period_us_g;
+    interrupts();
+
+    return period_us;
+}
+
+
+void set_idle_timeout(unsigned int timeout_ms) {
+
+    if (timeout_ms > 16383)
+        timeout_ms = 16383;
+
+    idle_timeout_ms_g = timeout_ms;
+
+    // non-zero timeouts last at least one full scan
+    uint16_t scans = (unsigned long)timeout_ms * 1000UL / (MATRIX_NB_COLS * KBD_COLUMN_PERIOD_US);
+    if (timeout_ms != 0 && scans == 0)
+        scans = 1;
+
+    noInterrupts();
+    idle_after_scans_g = scans;
+    interrupts();
+}
+
+
+unsigned int get_idle_timeout(void) {
+
+    return idle_timeout_ms_g;
 }
 
 
 void select_keyboard_column(unsigned int column) {
 
+#if KBD_DIRECT_PORT_IO
+    select_keyboard_column_vport(column);
+#else
+    select_keyboard_column_digital(column);
+#endif
+}
+
+
+void read_all_switches(byte* switches) {
+
+#if KBD_DIRECT_PORT_IO
+    read_all_switches_vport(switches);
+#else
+    read_all_switches_digital(switches);
+#endif
+}
+
+
+void select_keyboard_column_digital(unsigned int column) {
+
     digitalWrite(T0, column == 0 ? HIGH : LOW);
     digitalWrite(T1, column == 1 ? HIGH : LOW);
     digitalWrite(T2, column == 2 ? HIGH : LOW);
@@ -129,7 +446,7 @@ void select_keyboard_column(unsigned int column) {
 }
 
 
-void read_all_switches(byte* switches) {
+void read_all_switches_digital(byte* switches) {
 
     switches[0] = 0;
     switches[1] = 0;
@@ -162,6 +479,134 @@ void read_all_switches(byte* switches) {
     }
 }
 
+
+#ifdef __AVR_ATmega4809__
+
+// T[7:0] output values, indexed by column (only one T line is high at a time)
+static const byte t_portd_g[MATRIX_NB_COLS] = { PIN3_bm, PIN2_bm, PIN1_bm, PIN0_bm, 0, 0, PIN4_bm, PIN5_bm };
+static const byte t_portf_g[MATRIX_NB_COLS] = { 0, 0, 0, 0, PIN2_bm, PIN3_bm, 0, 0 };
+
+
+void select_keyboard_column_vport(unsigned int column) {
+
+    // PORTD only holds T lines; on PORTF, MUX_A2 (PF4) is the only other output
+    // and read_all_switches_vport() always leaves the mux address at 0, so both
+    // ports can be written as a whole (OUT has no effect on the MKA input).
+    VPORTD.OUT = t_portd_g[column];
+    VPORTF.OUT = t_portf_g[column];
+}
+
+
+/*
+  Samples the four switch lines for the current multiplexer address and stores
+  them at the mux position in the lower (B) and upper (A) keyboards 16-bit words.
+  mux is a compile-time constant once inlined, so all shifts are folded.
+*/
+static inline __attribute__((always_inline)) void sample_mux(byte mux, uint16_t* lower, uint16_t* upper) {
+
+    _delay_us(KBD_MUX_SETTLE_US);
+
+    byte pc = VPORTC.IN;
+    byte pa = VPORTA.IN;
+    byte pf = VPORTF.IN;
+
+    byte b = ((pc & MKB_bm) ? 0x01 : 0x00) | ((pa & BRB_bm) ? 0x02 : 0x00);
+    byte a = ((pf & MKA_bm) ? 0x01 : 0x00) | ((pc & BRA_bm) ? 0x02 : 0x00);
+
+    *lower |= (uint16_t)b << (mux * 2);
+    *upper |= (uint16_t)a << (mux * 2);
+}
+
+
+void read_all_switches_vport(byte* switches) {
+
+    uint16_t lower = 0;
+    uint16_t upper = 0;
+
+    _delay_us(KBD_COLUMN_SETTLE_US);
+
+    // mux address is 0 on entry; Gray code walk: 0 1 3 2 6 7 5 4
+    sample_mux(0, &lower, &upper);
+    VPORTB.OUT |= MUX_A1_bm;
+    sample_mux(1, &lower, &upper);
+    VPORTF.OUT |= MUX_A2_bm;
+    sample_mux(3, &lower, &upper);
+    VPORTB.OUT &= ~MUX_A1_bm;
+    sample_mux(2, &lower, &upper);
+    VPORTA.OUT |= MUX_A3_bm;
+    sample_mux(6, &lower, &upper);
+    VPORTB.OUT |= MUX_A1_bm;
+    sample_mux(7, &lower, &upper);
+    VPORTF.OUT &= ~MUX_A2_bm;
+    sample_mux(5, &lower, &upper);
+    VPORTB.OUT &= ~MUX_A1_bm;
+    sample_mux(4, &lower, &upper);
+
+    // back to address 0 for the next column
+    VPORTA.OUT &= ~MUX_A3_bm;
+
+    switches[0] = lower & 0xFF;
+    switches[1] = lower >> 8;
+    switches[2] = upper & 0xFF;
+    switches[3] = upper >> 8;
+}
+
+#endif // __AVR_ATmega4809__
+
+
+#ifdef KBD_SCAN_BENCHMARK
+
+/*
+  Returns the number of CPU cycles taken by one full matrix scan, averaged
+  over KBD_BENCHMARK_SCANS scans.
+*/
+static unsigned long time_full_scans(void (*select_column)(unsigned int), void (*read_switches)(byte*)) {
+
+    byte switches[4];
+
+    unsigned long start = micros();
+
+    for (unsigned int scan = 0; scan < KBD_BENCHMARK_SCANS; scan++) {
+        for (unsigned int column = 0; column < MATRIX_NB_COLS; column++) {
+            select_column(column);
+            read_switches(switches);
+        }
+    }
+
+    unsigned long elapsed = micros() - start;
+
+    return (elapsed * (F_CPU / 1000000UL)) / KBD_BENCHMARK_SCANS;
+}
+
+
+void report_scan_benchmark(void) {
+
+    unsigned long digital_cycles = time_full_scans(select_keyboard_column_digital, read_all_switches_digital);
+
+    Serial.print(F("full matrix scan, digitalWrite/digitalRead: "));
+    Serial.print(digital_cycles);
+    Serial.println(F(" cycles"));
+
+#ifdef __AVR_ATmega4809__
+    // the VPORT walk expects the multiplexer address to be 0
+    digitalWrite(MUX_A1, LOW);
+    digitalWrite(MUX_A2, LOW);
+    digitalWrite(MUX_A3, LOW);
+
+    unsigned long vport_cycles = time_full_scans(select_keyboard_column_vport, read_all_switches_vport);
+
+    Serial.print(F("full matrix scan, VPORT:                     "));
+    Serial.print(vport_cycles);
+    Serial.println(F(" cycles"));
+#endif
+
+    // leave the matrix in its idle state
+    select_keyboard_column(0);
+}
+
+#endif // KBD_SCAN_BENCHMARK
+
+
 void look_for_changes(byte* values, byte col) {
 
     // make a 32-bit word from 4 bytes
@@ -172,81 +617,142 @@ void look_for_changes(byte* values, byte col) {
 
     unsigned long changed = new_value ^ old_value_g[col];
 
-    if (changed) {
-        // store new value
-        old_value_g[col] = new_value;
+    if (!changed)
+        return;
+
+    // store new value
+    old_value_g[col] = new_value;
 
-        unsigned long mask = 0x01;
+    event_time_g = micros();
 
-        for (byte row = 0; row < MATRIX_NB_ROWS; row++, mask <<= 1) {
-            if (changed & mask)
-                notify_toggle(row, col, (new_value & mask) ? CLOSED : OPEN);
-        }
-    }
+    unsigned long closed = changed & new_value;
+    unsigned long opened = changed & ~new_value;
+
+    // contacts edges, break contacts moved onto their make contact bit
+    unsigned long brk_closed = (closed & BREAK_CONTACTS) >> 1;
+    unsigned long mk_closed = closed & MAKE_CONTACTS;
+
+    unsigned long* note_on_sent = &note_on_sent_g[col];
+    unsigned long* note_off_sent = &note_off_sent_g[col];
+
+    // Edges seen in the same scan are processed in the contacts order:
+    // break closing, make closing (key going down), then make opening,
+    // break opening (key going up).
+
+    // break contacts closing re-arm the Note On/Off debouncing mechanism
+    // and start the velocity measurement
+    *note_on_sent &= ~brk_closed;
+    *note_off_sent &= ~brk_closed;
+    stamp_keys(brk_closed, col);
+
+    unsigned long fire_on = mk_closed & ~*note_on_sent;
+    *note_on_sent |= fire_on;
+    send_keys(fire_on, col, ON);
+
+#if KBD_RELEASE_VELOCITY
+    // make contacts opening start the release velocity measurement,
+    // the Note Off is sent when the key is back to its rest position
+    stamp_keys(opened & MAKE_CONTACTS, col);
+
+    unsigned long brk_opened = (opened & BREAK_CONTACTS) >> 1;
+    unsigned long fire_off = brk_opened & *note_on_sent & ~*note_off_sent;
+#else
+    unsigned long mk_opened = opened & MAKE_CONTACTS;
+    unsigned long fire_off = mk_opened & ~*note_off_sent;
+#endif
+    *note_off_sent |= fire_off;
+    send_keys(fire_off, col, OFF);
 }
 
 
-void notify_toggle(byte row, byte col, bool closed) {
+static void stamp_keys(unsigned long keys, byte col) {
 
-    // determine key number, with col[7:0] and row[31:0]
-    // key = 127 to 64 for ukb, 63 to 0 for lkb
-    int key = 8 * (row / 2) + col;
+    while (keys) {
+        byte row = __builtin_ctzl(keys);
+        keys &= keys - 1;
 
-    // determine MIDI channel
-    byte chnl = (key >= 64 ? UPPER : LOWER);
+        key_time_g[8 * (row / 2) + col] = event_time_g;
+    }
+}
 
-    // check if key is assigned to a break switch
-    byte brk = (row & 1);  // odd numbers
 
-    // determine pitch (note number of a 61-note keyboard)
-    // 36 is the lowest C key value of a 5-octave keyboard (C1)
-    // 96 is C6
-    int pitch = (key % 64) + 36;
+static void send_keys(unsigned long keys, byte col, bool on) {
+
+    while (keys) {
+        byte row = __builtin_ctzl(keys);
+        keys &= keys - 1;
+
+        // determine key number, with col[7:0] and row[31:0]
+        // key = 127 to 64 for ukb, 63 to 0 for lkb
+        byte key = 8 * (row / 2) + col;
+
+#if KBD_RELEASE_VELOCITY
+        byte velocity = velocity_from_delta(event_time_g - key_time_g[key]);
+#else
+        byte velocity = on ? velocity_from_delta(event_time_g - key_time_g[key]) : VELOCITY_MIN;
+#endif
+        note_event ev;
+        ev.key = key;
+        ev.on = on;
+        ev.velocity = velocity;
+#ifdef KBD_LATENCY_STATS
+        ev.scan_time = (uint16_t)event_time_g;
+#endif
+        note_queue_push(&ev);
+    }
+}
 
-    // ensure valid pitch range
-    if (pitch > 96)
-        pitch = 96;
-    else if (pitch < 0)
-        pitch = 0;
 
-    // determine key mask and pointers for access to combined arrays
-    byte key_mask = (1 << (key % 8));
+void dump_key_state(void) {
 
-    byte* note_on_sent = (byte*)&note_on_sent_g[key / 8];
-    byte* note_off_sent = (byte*)&note_off_sent_g[key / 8];
+    byte msg[5 + KEY_STATE_SYSEX_LEN];
 
-    // break contacts do not send MIDI notes, they release the Note On/Off debouncing mechanism
-    if (brk) {
-        if (closed) {
-            *note_on_sent &= ~key_mask;
-            *note_off_sent &= ~key_mask;
-        }
-        return;
+    msg[0] = SYSEX_START;
+    msg[1] = SYSEX_NON_COMMERCIAL_ID;
+    msg[2] = KBD_SYSEX_DEVICE_ID;
+    msg[3] = KBD_CMD_KEY_STATE_DUMP;
+
+    for (byte i = 0; i < KEY_STATE_SYSEX_LEN; i++)
+        msg[4 + i] = 0;
+
+    for (byte key = 0; key < KEY_MAP_SIZE; key++) {
+        if (sounding_g[key / 8] & (1 << (key % 8)))
+            msg[4 + key / 7] |= 1 << (key % 7);
     }
 
-    // make switch depressed or released?
-    if (closed) {
+    msg[4 + KEY_STATE_SYSEX_LEN] = SYSEX_END;
 
-        if (!(*note_on_sent & key_mask)) {
-            *note_on_sent |= key_mask;
-            send_note(chnl, pitch, ON);
-        }
+    midi_out_sysex(msg, sizeof(msg));
+}
 
-    } else {
 
-        if (!(*note_off_sent & key_mask)) {
-            *note_off_sent |= key_mask;
-            send_note(chnl, pitch, OFF);
-        }
+void sync_key_state(const byte* packed) {
+
+    for (byte key = 0; key < KEY_MAP_SIZE; key++) {
+
+        bool host_down = packed[key / 7] & (1 << (key % 7));
+        bool down = sounding_g[key / 8] & (1 << (key % 8));
+
+        if (host_down == down)
+            continue;
+
+        // play_key() is not used: it would update sounding_g, which is right already
+        const key_map_entry* entry = &playing_g[key];
+
+        if (entry->flags & KEY_MUTED)
+            continue;
+
+        byte velocity = down ? VELOCITY_RESYNC : VELOCITY_MIN;
+
+        send_note(entry->chnl, entry->pitch, down, velocity);
+
+        if (entry->flags & KEY_LAYERED)
+            send_note(entry->flags & KEY_LAYER_CHNL, entry->pitch, down, velocity);
     }
 }
 
 
-void send_note(byte chnl, byte pitch, bool on) {
+void send_note(byte chnl, byte pitch, bool on, byte velocity) {
 
-    byte bytes[3];
-    bytes[0] = on ? (NOTE_ON | chnl) : (NOTE_OFF | chnl);
-    bytes[1] = pitch;
-    bytes[2] = on ? VELOCITY_MAX : VELOCITY_MIN;
-    Serial.write(bytes, 3);
+    midi_out_note(on ? (NOTE_ON | chnl) : (NOTE_OFF | chnl), pitch, velocity);
 }
@@ -0,0 +1,57 @@
+#include "b3_keymap.h"
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+/******************************************************************
+  The active key map lives in RAM so that the Raspberry PI can load
+  splits, transpositions and layered (coupled) manuals at run time.
+  Turning a key event into MIDI channel and pitch is a single table
+  read in loop().
+ ******************************************************************/
+
+static_assert(KEY_MAP_SIZE == 128, "default key map is generated for 128 keys");
+
+// lowest C key value of a 5-octave keyboard (C1) and highest one (C6)
+constexpr int LOWEST_PITCH = 36;
+constexpr int HIGHEST_PITCH = 96;
+
+constexpr byte default_pitch(int key) {
+    return (byte)((key % 64) + LOWEST_PITCH > HIGHEST_PITCH ? HIGHEST_PITCH : (key % 64) + LOWEST_PITCH);
+}
+
+constexpr key_map_entry default_entry(int key) {
+    return key_map_entry{ (byte)(key >= 64 ? UPPER : LOWER), default_pitch(key), 0 };
+}
+
+#define KEYS_4(k) default_entry(k), default_entry(k + 1), default_entry(k + 2), default_entry(k + 3)
+#define KEYS_16(k) KEYS_4(k), KEYS_4(k + 4), KEYS_4(k + 8), KEYS_4(k + 12)
+#define KEYS_64(k) KEYS_16(k), KEYS_16(k + 16), KEYS_16(k + 32), KEYS_16(k + 48)
+
+static const key_map_entry default_key_map_g[KEY_MAP_SIZE] PROGMEM = {
+    KEYS_64(0), KEYS_64(64)
+};
+
+static key_map_entry key_map_g[KEY_MAP_SIZE];
+
+
+void key_map_init(void) {
+
+    memcpy_P(key_map_g, default_key_map_g, sizeof(key_map_g));
+}
+
+
+void key_map_set(byte key, const key_map_entry* entry) {
+
+    if (key >= KEY_MAP_SIZE)
+        return;
+
+    key_map_g[key].chnl = entry->chnl & 0x0F;
+    key_map_g[key].pitch = entry->pitch & 0x7F;
+    key_map_g[key].flags = entry->flags & (KEY_MUTED | KEY_LAYERED | KEY_LAYER_CHNL);
+}
+
+
+const key_map_entry* key_map_get(byte key) {
+
+    return &key_map_g[key];
+}
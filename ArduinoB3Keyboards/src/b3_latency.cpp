@@ -0,0 +1,52 @@
+#include "b3_latency.h"
+#include <Arduino.h>
+#include <B3Midi.h>
+
+
+void latency_reset(latency_stats* stats, byte bucket_shift) {
+
+    stats->count = 0;
+    stats->sum = 0;
+    stats->min = 0xFFFF;
+    stats->max = 0;
+
+    for (byte i = 0; i < LATENCY_NB_BUCKETS; i++)
+        stats->buckets[i] = 0;
+
+    stats->bucket_shift = bucket_shift;
+}
+
+
+void latency_record(latency_stats* stats, uint16_t us) {
+
+    stats->count++;
+    stats->sum += us;
+
+    if (us < stats->min)
+        stats->min = us;
+    if (us > stats->max)
+        stats->max = us;
+
+    // bucket = number of significant bits above the bucket shift
+    uint16_t v = us >> stats->bucket_shift;
+    byte bucket = 0;
+    while (v != 0 && bucket < LATENCY_NB_BUCKETS - 1) {
+        v >>= 1;
+        bucket++;
+    }
+
+    if (stats->buckets[bucket] != 0xFFFF)
+        stats->buckets[bucket]++;
+}
+
+
+void latency_to_sysex(const latency_stats* stats, byte* data) {
+
+    data = putSysExCount(data, stats->count);
+    data = putSysExCount(data, stats->count ? stats->min : 0);
+    data = putSysExCount(data, stats->count ? stats->sum / stats->count : 0);
+    data = putSysExCount(data, stats->max);
+
+    for (byte i = 0; i < LATENCY_NB_BUCKETS; i++)
+        data = putSysExCount(data, stats->buckets[i]);
+}
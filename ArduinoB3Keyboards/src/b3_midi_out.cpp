@@ -0,0 +1,75 @@
+#include "b3_midi_out.h"
+#include <Arduino.h>
+
+/******************************************************************
+  Output stage of the keyboards firmware.
+
+  loop() gathers all the note events queued by the scan interrupt
+  since its previous pass into one buffer, then writes it at once.
+  Consecutive messages with the same status byte (same Note On/Off
+  type on the same channel) are sent with running status: only the
+  first one carries the status byte, the next ones are 2 bytes long.
+ ******************************************************************/
+
+static byte buffer_g[MIDI_OUT_BUFFER_SIZE];
+static unsigned int length_g = 0;
+
+// status byte of the last message sent; 0 when the next message must carry it
+static byte running_status_g = 0;
+
+static unsigned long last_write_ms_g = 0;
+static unsigned long bytes_saved_g = 0;
+
+
+void midi_out_note(byte status, byte pitch, byte velocity) {
+
+    if ((status & 0xF0) == NOTE_OFF && (KBD_NOTE_OFF_AS_NOTE_ON || velocity == VELOCITY_MIN)) {
+        status = NOTE_ON | (status & 0x0F);
+        velocity = VELOCITY_MIN;
+    }
+
+    if (length_g > MIDI_OUT_BUFFER_SIZE - 3)
+        midi_out_flush();
+
+    if (length_g == 0 && millis() - last_write_ms_g >= MIDI_OUT_RUNNING_STATUS_TIMEOUT_MS)
+        running_status_g = 0;
+
+    if (status != running_status_g) {
+        buffer_g[length_g++] = status;
+        running_status_g = status;
+    } else {
+        bytes_saved_g++;
+    }
+
+    buffer_g[length_g++] = pitch;
+    buffer_g[length_g++] = velocity;
+}
+
+
+void midi_out_sysex(const byte* msg, unsigned int len) {
+
+    if (length_g > MIDI_OUT_BUFFER_SIZE - len)
+        midi_out_flush();
+
+    for (unsigned int i = 0; i < len; i++)
+        buffer_g[length_g++] = msg[i];
+
+    running_status_g = 0;
+}
+
+
+void midi_out_flush(void) {
+
+    if (length_g == 0)
+        return;
+
+    Serial.write(buffer_g, length_g);
+    length_g = 0;
+    last_write_ms_g = millis();
+}
+
+
+unsigned long midi_out_bytes_saved(void) {
+
+    return bytes_saved_g;
+}
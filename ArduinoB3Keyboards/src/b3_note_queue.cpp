@@ -0,0 +1,94 @@
+#include "b3_note_queue.h"
+#include <Arduino.h>
+
+/******************************************************************
+  Lock-free single-producer / single-consumer ring buffer.
+
+  The write index is only modified by the producer (scan interrupt),
+  the read index only by the consumer (loop). Both are free-running
+  8-bit counters, read and written in a single instruction on AVR, so
+  no interrupt masking is needed on either side. The number of queued
+  events is (write - read) modulo 256, which is why NOTE_QUEUE_SIZE
+  must be a power of two not greater than 128.
+ ******************************************************************/
+
+#if (NOTE_QUEUE_SIZE & (NOTE_QUEUE_SIZE - 1)) != 0 || NOTE_QUEUE_SIZE > 128
+#error "NOTE_QUEUE_SIZE must be a power of two <= 128"
+#endif
+
+static note_event events_g[NOTE_QUEUE_SIZE];
+
+static volatile byte write_idx_g;
+static volatile byte read_idx_g;
+
+// statistics, only written by the producer
+static volatile byte high_water_g;
+static volatile unsigned int overflows_g;
+
+
+void note_queue_init(void) {
+
+    write_idx_g = 0;
+    read_idx_g = 0;
+    high_water_g = 0;
+    overflows_g = 0;
+}
+
+
+bool note_queue_push(const note_event* ev) {
+
+    byte w = write_idx_g;
+    byte used = (byte)(w - read_idx_g);
+
+    if (used >= NOTE_QUEUE_SIZE) {
+        overflows_g++;
+        return false;
+    }
+
+    events_g[w & (NOTE_QUEUE_SIZE - 1)] = *ev;
+
+    // the event must be in place before the consumer can see it
+    __asm__ __volatile__("" ::: "memory");
+    write_idx_g = w + 1;
+
+    if (used + 1 > high_water_g)
+        high_water_g = used + 1;
+
+    return true;
+}
+
+
+bool note_queue_pop(note_event* ev) {
+
+    byte r = read_idx_g;
+
+    if (r == write_idx_g)
+        return false;
+
+    *ev = events_g[r & (NOTE_QUEUE_SIZE - 1)];
+
+    // the slot must be copied before the producer can reuse it
+    __asm__ __volatile__("" ::: "memory");
+    read_idx_g = r + 1;
+
+    return true;
+}
+
+
+byte note_queue_high_water(void) {
+
+    return high_water_g;
+}
+
+
+unsigned int note_queue_overflows(void) {
+
+    unsigned int overflows;
+
+    // 16-bit value written by the interrupt
+    noInterrupts();
+    overflows = overflows_g;
+    interrupts();
+
+    return overflows;
+}
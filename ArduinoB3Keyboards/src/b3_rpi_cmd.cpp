@@ -0,0 +1,137 @@
+#include "b3_rpi_cmd.h"
+#include "b3_keyboards.h"
+#include "b3_keymap.h"
+#include "b3_midi_out.h"
+#include "b3_note_queue.h"
+#include "b3_velocity.h"
+#include <Arduino.h>
+
+// SysEx message being received, F0 excluded; len_g is 0 when outside of a message
+static byte cmd_g[RPI_CMD_BUFFER_SIZE];
+static byte len_g = 0;
+static bool in_sysex_g = false;
+
+static void run_rpi_cmd(const byte* cmd, byte len);
+static void report_scan_status(void);
+
+
+void on_rpi_cmd(void) {
+
+    while (Serial.available() > 0) {
+
+        byte b = Serial.read();
+
+        // real time messages may show up anywhere, even inside a SysEx
+        if (b >= 0xF8)
+            continue;
+
+        if (b == SYSEX_START) {
+            in_sysex_g = true;
+            len_g = 0;
+            continue;
+        }
+
+        if (!in_sysex_g)
+            continue;
+
+        if (b == SYSEX_END) {
+            in_sysex_g = false;
+            run_rpi_cmd(cmd_g, len_g);
+            continue;
+        }
+
+        if (b & 0x80 || len_g == RPI_CMD_BUFFER_SIZE) {
+            // another status byte cut the message, or it is too long for us
+            in_sysex_g = false;
+            continue;
+        }
+
+        cmd_g[len_g++] = b;
+    }
+}
+
+
+/*
+  cmd : manufacturer ID, device ID, command and its data
+*/
+static void run_rpi_cmd(const byte* cmd, byte len) {
+
+    if (len < 3 || cmd[0] != SYSEX_NON_COMMERCIAL_ID || cmd[1] != KBD_SYSEX_DEVICE_ID)
+        return;
+
+    const byte* data = cmd + 3;
+    byte data_len = len - 3;
+
+    switch (cmd[2]) {
+
+    case KBD_CMD_KEY_MAP_SET:
+        if (data_len < 1 || (data_len - 1) % 3 != 0)
+            return;
+        for (byte i = 0; i < (data_len - 1) / 3; i++) {
+            const byte* e = &data[1 + 3 * i];
+            key_map_entry entry = { e[0], e[1], e[2] };
+            key_map_set(data[0] + i, &entry);
+        }
+        break;
+
+    case KBD_CMD_KEY_MAP_DEFAULT:
+        key_map_init();
+        break;
+
+    case KBD_CMD_VELOCITY_CURVE:
+        if (data_len == 1)
+            set_velocity_curve(data[0]);
+        break;
+
+    case KBD_CMD_KEY_STATE_DUMP:
+        dump_key_state();
+        break;
+
+    case KBD_CMD_KEY_STATE_SYNC:
+        if (data_len == KEY_STATE_SYSEX_LEN)
+            sync_key_state(data);
+        break;
+
+    case KBD_CMD_SCAN_STATUS:
+        report_scan_status();
+        break;
+
+    case KBD_CMD_IDLE_TIMEOUT:
+        if (data_len == 2)
+            set_idle_timeout(data[0] | (data[1] << 7));
+        break;
+
+#ifdef KBD_LATENCY_STATS
+    case KBD_CMD_LATENCY_REPORT:
+        report_latency_stats();
+        break;
+
+    case KBD_CMD_LATENCY_RESET:
+        reset_latency_stats();
+        break;
+#endif
+    }
+}
+
+
+static void report_scan_status(void) {
+
+    unsigned int period_us = get_column_period_us();
+    unsigned int timeout_ms = get_idle_timeout();
+    unsigned int overflows = note_queue_overflows();
+
+    byte msg[] = {
+        SYSEX_START, SYSEX_NON_COMMERCIAL_ID, KBD_SYSEX_DEVICE_ID, KBD_CMD_SCAN_STATUS,
+        (byte)(period_us != KBD_COLUMN_PERIOD_US),
+        (byte)(period_us & 0x7F), (byte)((period_us >> 7) & 0x7F),
+        (byte)(timeout_ms & 0x7F), (byte)((timeout_ms >> 7) & 0x7F),
+        (byte)(note_queue_high_water() & 0x7F),
+        (byte)(overflows > 0x7F ? 0x7F : overflows),
+        0, 0, 0,
+        SYSEX_END
+    };
+
+    putSysExCount(&msg[11], midi_out_bytes_saved());
+
+    midi_out_sysex(msg, sizeof(msg));
+}
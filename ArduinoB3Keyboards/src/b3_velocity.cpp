@@ -0,0 +1,69 @@
+#include "b3_velocity.h"
+#include "b3_keyboards.h"
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+/******************************************************************
+  Velocity curves are computed at compile time into flash tables:
+  converting a contacts delta into a velocity is a shift and a
+  single pgm_read_byte() in the scan interrupt.
+
+  x is the table position scaled to [0..1024], y the curve value
+  in the same range, mapped to the [1..127] MIDI velocity range.
+ ******************************************************************/
+
+static_assert(VELOCITY_TABLE_SIZE == 128, "velocity tables are generated for 128 entries");
+static_assert(VELOCITY_DELTA_STEP_US == 256, "velocity_from_delta() divides by shifting");
+
+constexpr long curve_x(int i) {
+    return (1024L * i) / (VELOCITY_TABLE_SIZE - 1);
+}
+
+constexpr byte curve_velocity(long y) {
+    return (byte)(1 + (126L * y) / 1024L);
+}
+
+constexpr byte curve_value(int curve, int i) {
+    return curve == VELOCITY_CURVE_LINEAR ? curve_velocity(1024L - curve_x(i)) :
+           curve == VELOCITY_CURVE_SOFT ? curve_velocity(1024L - (curve_x(i) * curve_x(i)) / 1024L) :
+           curve == VELOCITY_CURVE_HARD ? curve_velocity(((1024L - curve_x(i)) * (1024L - curve_x(i))) / 1024L) :
+           VELOCITY_MAX;
+}
+
+#define CURVE_4(c, i) curve_value(c, i), curve_value(c, i + 1), curve_value(c, i + 2), curve_value(c, i + 3)
+#define CURVE_16(c, i) CURVE_4(c, i), CURVE_4(c, i + 4), CURVE_4(c, i + 8), CURVE_4(c, i + 12)
+#define CURVE_64(c, i) CURVE_16(c, i), CURVE_16(c, i + 16), CURVE_16(c, i + 32), CURVE_16(c, i + 48)
+#define CURVE_128(c) { CURVE_64(c, 0), CURVE_64(c, 64) }
+
+static const byte velocity_curves_g[VELOCITY_NB_CURVES][VELOCITY_TABLE_SIZE] PROGMEM = {
+    CURVE_128(VELOCITY_CURVE_LINEAR),
+    CURVE_128(VELOCITY_CURVE_SOFT),
+    CURVE_128(VELOCITY_CURVE_HARD),
+    CURVE_128(VELOCITY_CURVE_FIXED)
+};
+
+static byte velocity_curve_g = KBD_VELOCITY_CURVE;
+
+
+void set_velocity_curve(byte curve) {
+
+    if (curve < VELOCITY_NB_CURVES)
+        velocity_curve_g = curve;
+}
+
+
+byte get_velocity_curve(void) {
+
+    return velocity_curve_g;
+}
+
+
+byte velocity_from_delta(unsigned long delta_us) {
+
+    byte idx = VELOCITY_TABLE_SIZE - 1;
+
+    if (delta_us < (unsigned long)VELOCITY_TABLE_SIZE * VELOCITY_DELTA_STEP_US)
+        idx = delta_us >> 8;
+
+    return pgm_read_byte(&velocity_curves_g[velocity_curve_g][idx]);
+}
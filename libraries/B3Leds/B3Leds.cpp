@@ -0,0 +1,162 @@
+/*
+ B3Leds.cpp - LED patterns of the B3 clone Arduino boards.
+*/
+
+#include "Arduino.h"
+#include "B3Leds.h"
+
+B3Leds::B3Leds(const int* pins, byte nbLeds) : _pins(pins)
+{
+    _nbLeds = min(nbLeds, (byte)B3_LEDS_MAX);
+    _levels = 0;
+    _shown = 0;
+    _pattern = NONE;
+    _leds = 0;
+    _periodMs = 1;
+    _count = 0;
+    _startMs = 0;
+}
+
+void B3Leds::write(int pin, bool on)
+{
+    for (byte i = 0; i < _nbLeds; i++) {
+
+        if (_pins[i] != pin)
+            continue;
+
+        bitWrite(_levels, i, on);
+
+        if (_pattern == NONE || !bitRead(_leds, i)) {
+            digitalWrite(pin, on ? HIGH : LOW);
+            bitWrite(_shown, i, on);
+        }
+        return;
+    }
+}
+
+void B3Leds::blink(byte leds, unsigned int periodMs, byte count)
+{
+    start(BLINK, leds, periodMs, count);
+}
+
+void B3Leds::chase(byte leds, unsigned int stepMs, byte count)
+{
+    start(CHASE, leds, stepMs, count);
+}
+
+void B3Leds::pulse(byte leds, unsigned int periodMs, byte count)
+{
+    start(PULSE, leds, periodMs, count);
+}
+
+void B3Leds::confirm(byte leds)
+{
+    start(CONFIRM, leds, B3_LEDS_CONFIRM_MS, 3);
+}
+
+void B3Leds::stop()
+{
+    _pattern = NONE;
+    show(_levels);
+}
+
+bool B3Leds::isRunning() const
+{
+    return _pattern != NONE;
+}
+
+void B3Leds::start(pattern p, byte leds, unsigned int periodMs, byte count)
+{
+    // the LEDs of the previous pattern not in the new one get their levels back
+    show(_levels);
+
+    _pattern = p;
+    _leds = leds & ((1 << _nbLeds) - 1);
+    _periodMs = max(periodMs, 1U);
+    _count = count;
+    _startMs = millis();
+
+    update();
+}
+
+void B3Leds::update()
+{
+    if (_pattern == NONE)
+        return;
+
+    unsigned long elapsed = millis() - _startMs;
+    unsigned long period = elapsed / _periodMs;
+    unsigned long phase = elapsed % _periodMs;
+    byte lit = 0;
+
+    switch (_pattern) {
+
+        case BLINK:
+            if (_count && period >= _count) {
+                stop();
+                return;
+            }
+            lit = phase < _periodMs / 2 ? _leds : 0;
+            break;
+
+        case CHASE: {
+            // here a period is one step: one LED of the mask
+            byte nb = 0;
+            for (byte i = 0; i < _nbLeds; i++)
+                nb += bitRead(_leds, i);
+
+            if (nb == 0 || (_count && period >= (unsigned long)nb * _count)) {
+                stop();
+                return;
+            }
+
+            byte step = period % nb;
+            for (byte i = 0; i < _nbLeds; i++) {
+                if (bitRead(_leds, i) && step-- == 0) {
+                    lit = bit(i);
+                    break;
+                }
+            }
+            break;
+        }
+
+        case PULSE: {
+            if (_count && period >= _count) {
+                stop();
+                return;
+            }
+            // triangle brightness [0..B3_LEDS_PWM_FRAME_MS], as the on time of each frame
+            unsigned long level = phase * 2 * B3_LEDS_PWM_FRAME_MS / _periodMs;
+            if (level > B3_LEDS_PWM_FRAME_MS)
+                level = 2 * B3_LEDS_PWM_FRAME_MS - level;
+
+            lit = elapsed % B3_LEDS_PWM_FRAME_MS < level ? _leds : 0;
+            break;
+        }
+
+        case CONFIRM:
+            if (period >= _count) {
+                stop();
+                return;
+            }
+            lit = period % 2 ? _levels & _leds : ~_levels & _leds;
+            break;
+
+        default:
+            break;
+    }
+
+    show((_levels & ~_leds) | lit);
+}
+
+void B3Leds::show(byte levels)
+{
+    byte changed = levels ^ _shown;
+
+    for (byte i = 0; i < _nbLeds; i++) {
+        if (bitRead(changed, i))
+            digitalWrite(_pins[i], bitRead(levels, i) ? HIGH : LOW);
+    }
+
+    _shown = levels;
+}
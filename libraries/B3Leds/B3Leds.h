@@ -0,0 +1,81 @@
+/*
+  B3Leds.h - LED patterns of the B3 clone Arduino boards.
+
+  Drives up to B3_LEDS_MAX LEDs. Each LED has a steady level, set by write();
+  a pattern (blink, chase, pulse or confirm) temporarily takes over a set of
+  LEDs, given as a mask of their indexes in the pins array, and gives them
+  back to their steady levels when it ends or is stopped. A new pattern
+  replaces the running one.
+
+  Nothing waits: patterns advance in update(), which must be called from
+  loop() at least every millisecond or so for pulse() to look smooth.
+
+    const int pins[] = {5, 6};
+    B3Leds leds(pins, 2);
+    ...
+    leds.blink(B3_LEDS_ALL, 400, 2);  // loop() calls leds.update()
+*/
+#ifndef B3LEDS_H_
+#define B3LEDS_H_
+
+#include "Arduino.h"
+
+#define B3_LEDS_MAX 8
+#define B3_LEDS_ALL 0xFF
+
+// software PWM frame of pulse(): 10 brightness levels at 100 Hz
+#define B3_LEDS_PWM_FRAME_MS 10
+
+// each of the three phases of confirm()
+#define B3_LEDS_CONFIRM_MS 100
+
+class B3Leds
+{
+    public:
+        // pins are not copied and shall be configured as outputs
+        B3Leds(const int* pins, byte nbLeds);
+
+        // steady level of the LED on the given pin, shown at once unless a
+        // pattern runs on it
+        void write(int pin, bool on);
+
+        // the LEDs are on for the first half of each period; count periods,
+        // or until stop() if 0
+        void blink(byte leds, unsigned int periodMs, byte count);
+
+        // the LEDs light one at a time, in index order, for stepMs each;
+        // count rounds, or until stop() if 0
+        void chase(byte leds, unsigned int stepMs, byte count);
+
+        // the LEDs fade in and out over each period; count periods,
+        // or until stop() if 0
+        void pulse(byte leds, unsigned int periodMs, byte count);
+
+        // the LEDs briefly flash to the opposite of their steady level, twice
+        void confirm(byte leds);
+
+        void stop();
+        bool isRunning() const;
+
+        // shows the running pattern; call from loop()
+        void update();
+
+    private:
+        enum pattern : byte { NONE, BLINK, CHASE, PULSE, CONFIRM };
+
+        const int* _pins;
+        byte _nbLeds;
+        byte _levels;
+        byte _shown;
+
+        pattern _pattern;
+        byte _leds;
+        unsigned int _periodMs;
+        byte _count;
+        unsigned long _startMs;
+
+        void start(pattern p, byte leds, unsigned int periodMs, byte count);
+        void show(byte levels);
+};
+
+#endif
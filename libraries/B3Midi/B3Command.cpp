@@ -0,0 +1,82 @@
+/*
+ B3Command.cpp - Raspberry PI commands reader of the B3 clone Arduino boards.
+*/
+
+#include "Arduino.h"
+#include "B3Command.h"
+
+B3Command::B3Command(Stream& stream) : _stream(stream)
+{
+    _length = 0;
+    _complete = false;
+    _overflow = false;
+    _overflows = 0;
+}
+
+bool B3Command::poll()
+{
+    if (_complete) {
+        _length = 0;
+        _complete = false;
+    }
+
+    while (_stream.available() > 0) {
+
+        char c = _stream.read();
+
+        if (c == '\r')
+            continue;
+
+        if (c == '\n') {
+            if (_overflow) {
+                // the end of a dropped line
+                _overflow = false;
+                _length = 0;
+                continue;
+            }
+            if (_length == 0)
+                continue;
+
+            // the following bytes are left for the next call
+            _line[_length] = '\0';
+            _complete = true;
+            return true;
+        }
+
+        if (_overflow)
+            continue;
+
+        if (_length < B3_COMMAND_BUFFER_SIZE - 1) {
+            _line[_length++] = c;
+        } else {
+            _overflow = true;
+            if (_overflows < 0xFFFF)
+                _overflows++;
+        }
+    }
+
+    return false;
+}
+
+uint16_t B3Command::code() const
+{
+    if (!_complete)
+        return 0;
+
+    return B3_COMMAND(_line[0], _length > 1 ? _line[1] : 0);
+}
+
+const char* B3Command::args() const
+{
+    return _complete && _length > 2 ? _line + 2 : "";
+}
+
+byte B3Command::argsLength() const
+{
+    return _complete && _length > 2 ? _length - 2 : 0;
+}
+
+uint16_t B3Command::overflows() const
+{
+    return _overflows;
+}
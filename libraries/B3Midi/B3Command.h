@@ -0,0 +1,59 @@
+/*
+  B3Command.h - Raspberry PI commands reader of the B3 clone Arduino boards.
+
+  Commands are lines of ASCII characters ended by '\n' ('\r' is ignored):
+  one or two command characters, possibly followed by arguments.
+  poll() takes whatever bytes are available on the stream and returns at
+  once; it never waits for the end of a line and never allocates memory.
+  Lines longer than B3_COMMAND_BUFFER_SIZE - 1 characters are dropped.
+
+  A complete command is dispatched with a switch on its code:
+
+    if (rpi_cmd.poll()) {
+        switch (rpi_cmd.code()) {
+            case B3_COMMAND('R', 0):
+                ...
+        }
+    }
+*/
+#ifndef B3COMMAND_H_
+#define B3COMMAND_H_
+
+#include "Arduino.h"
+
+#ifndef B3_COMMAND_BUFFER_SIZE
+#define B3_COMMAND_BUFFER_SIZE 32
+#endif
+
+// code of a command made of the characters c0 and c1 (0 for a one character command)
+#define B3_COMMAND(c0, c1) ((uint16_t)(byte)(c0) | ((uint16_t)(byte)(c1) << 8))
+
+class B3Command
+{
+    public:
+        B3Command(Stream& stream);
+
+        // reads the available bytes; true when a command line is complete,
+        // it then stays available until the next call
+        bool poll();
+
+        // code of the last complete command (see B3_COMMAND)
+        uint16_t code() const;
+
+        // characters following the two command characters, NUL terminated
+        const char* args() const;
+        byte argsLength() const;
+
+        // number of lines dropped because they did not fit into the buffer
+        uint16_t overflows() const;
+
+    private:
+        Stream& _stream;
+        char _line[B3_COMMAND_BUFFER_SIZE];
+        byte _length;
+        bool _complete;
+        bool _overflow;
+        uint16_t _overflows;
+};
+
+#endif
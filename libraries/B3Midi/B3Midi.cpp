@@ -45,3 +45,14 @@ void B3Midi::sendNoteOff(byte channel, byte pitch)
     Serial.write(bytes, 3);
 }
 
+byte* putSysExCount(byte* data, unsigned long count)
+{
+    if (count > SYSEX_COUNT_MAX)
+        count = SYSEX_COUNT_MAX;
+
+    *data++ = count & 0x7F;
+    *data++ = (count >> 7) & 0x7F;
+    *data++ = (count >> 14) & 0x7F;
+
+    return data;
+}
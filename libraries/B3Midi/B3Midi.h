@@ -12,6 +12,18 @@
 #define VELOCITY_MIN 0
 #define VELOCITY_MAX 0x7F
 
+// System Exclusive messages of the B3 clone boards: F0 7D <device> <cmd> ... F7
+#define SYSEX_START 0xF0
+#define SYSEX_END 0xF7
+#define SYSEX_NON_COMMERCIAL_ID 0x7D
+
+// largest count putSysExCount() can send
+#define SYSEX_COUNT_MAX 0x1FFFFFUL
+
+// writes a count into a SysEx message as 3 bytes of 7 bits, LSB first,
+// saturated at SYSEX_COUNT_MAX; returns the byte following them
+byte* putSysExCount(byte* data, unsigned long count);
+
 class B3Midi
 {
     public: